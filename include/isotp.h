@@ -0,0 +1,285 @@
+#ifndef ISOTP_H
+#define ISOTP_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                 ISO-TP (ISO 15765-2) frame builders / parsers               */
+/* -------------------------------------------------------------------------- */
+// Header-only codec shared by all firmwares. Everything that
+// differs between bus setups (addressing, padding, DLC, max payload) is a
+// template parameter, so each instantiation compiles down to fixed-offset
+// loads and stores with no runtime dispatch. The codec only touches raw frame
+// bytes (twai_message_t::data); identifiers and transmission stay with the
+// caller.
+
+namespace isotp
+{
+
+// value for PAD that disables padding: frames are sent with the shortest DLC
+static constexpr uint16_t NO_PADDING = 0x100;
+
+// ISO-TP limit for the 12 bit first frame length
+static constexpr uint16_t MAX_FF_LEN = 0x0FFF;
+
+enum class addressing_t : uint8_t
+{
+    NORMAL,   // PCI starts at byte 0
+    EXTENDED, // byte 0 is target address, PCI starts at byte 1
+};
+
+enum class frame_type_t : uint8_t
+{
+    SINGLE = 0x00,
+    FIRST = 0x01,
+    CONSECUTIVE = 0x02,
+    FLOW = 0x03,
+};
+
+enum class flow_status_t : uint8_t
+{
+    CLEAR_TO_SEND = 0x00,
+    WAIT = 0x01,
+    OVERFLOW = 0x02,
+};
+
+template <addressing_t ADDR, uint16_t PAD, uint8_t DLC, uint16_t MAX_PAYLOAD>
+struct codec_t
+{
+    // byte offset of the protocol control information
+    static constexpr uint8_t PCI_POS = (ADDR == addressing_t::EXTENDED) ? 1 : 0;
+
+    // payload capacity of each frame type
+    static constexpr uint8_t SF_DATA_MAX = DLC - PCI_POS - 1;
+    static constexpr uint8_t FF_DATA_LEN = DLC - PCI_POS - 2;
+    static constexpr uint8_t CF_DATA_MAX = DLC - PCI_POS - 1;
+    static constexpr uint16_t MAX_LEN = MAX_PAYLOAD;
+    static constexpr uint8_t FRAME_LEN = DLC;
+
+    static_assert(DLC <= 8, "classic CAN frames carry at most 8 bytes");
+    static_assert(DLC >= PCI_POS + 3, "DLC too small for a flow control frame");
+    static_assert(PAD <= NO_PADDING, "PAD must be a byte value or NO_PADDING");
+    static_assert(MAX_PAYLOAD <= MAX_FF_LEN, "payload exceeds 12 bit FF length");
+
+    /* ------------------------------- builders ------------------------------ */
+    // All builders fill frame[0..DLC) and return the data length code to put
+    // in the message. The caller guarantees the payload fits the frame type.
+
+    static inline uint8_t single(
+        uint8_t *frame,
+        const uint8_t *dta,
+        uint8_t len,
+        uint8_t ta = 0)
+    {
+        prepare(frame, ta);
+        frame[PCI_POS] = len & 0x0F; // 0x0L
+        memcpy(&frame[PCI_POS + 1], dta, len);
+        return finish(PCI_POS + 1 + len);
+    }
+
+    static inline uint8_t first(
+        uint8_t *frame,
+        const uint8_t *dta,
+        uint16_t total_len,
+        uint8_t ta = 0)
+    {
+        prepare(frame, ta);
+        frame[PCI_POS] = 0x10 | ((total_len >> 8) & 0x0F); // 0x1L LL
+        frame[PCI_POS + 1] = total_len & 0xFF;
+        memcpy(&frame[PCI_POS + 2], dta, FF_DATA_LEN);
+        return DLC;
+    }
+
+    static inline uint8_t consecutive(
+        uint8_t *frame,
+        uint8_t sn,
+        const uint8_t *dta,
+        uint8_t len,
+        uint8_t ta = 0)
+    {
+        prepare(frame, ta);
+        frame[PCI_POS] = 0x20 | (sn & 0x0F); // 0x2N
+        memcpy(&frame[PCI_POS + 1], dta, len);
+        return finish(PCI_POS + 1 + len);
+    }
+
+    static inline uint8_t flow(
+        uint8_t *frame,
+        flow_status_t fs,
+        uint8_t block_size,
+        uint8_t st_min,
+        uint8_t ta = 0)
+    {
+        prepare(frame, ta);
+        frame[PCI_POS] = 0x30 | (uint8_t)fs; // 0x3S BS ST
+        frame[PCI_POS + 1] = block_size;
+        frame[PCI_POS + 2] = st_min;
+        return finish(PCI_POS + 3);
+    }
+
+    // payload bytes carried by the next consecutive frame
+    static constexpr uint8_t consecutive_len(uint16_t rem)
+    {
+        return (rem < CF_DATA_MAX) ? (uint8_t)rem : CF_DATA_MAX;
+    }
+
+    /* ------------------------------- parsers ------------------------------- */
+
+    static inline uint8_t target(const uint8_t *frame)
+    {
+        return (PCI_POS) ? frame[0] : 0;
+    }
+
+    static inline frame_type_t type(const uint8_t *frame)
+    {
+        return (frame_type_t)((frame[PCI_POS] >> 4) & 0x0F);
+    }
+
+    static inline uint8_t single_len(const uint8_t *frame)
+    {
+        return frame[PCI_POS] & 0x0F;
+    }
+
+    static inline const uint8_t *single_dta(const uint8_t *frame)
+    {
+        return &frame[PCI_POS + 1];
+    }
+
+    static inline uint16_t first_len(const uint8_t *frame)
+    {
+        return ((uint16_t)(frame[PCI_POS] & 0x0F) << 8) | frame[PCI_POS + 1];
+    }
+
+    static inline const uint8_t *first_dta(const uint8_t *frame)
+    {
+        return &frame[PCI_POS + 2];
+    }
+
+    static inline uint8_t consecutive_sn(const uint8_t *frame)
+    {
+        return frame[PCI_POS] & 0x0F;
+    }
+
+    static inline const uint8_t *consecutive_dta(const uint8_t *frame)
+    {
+        return &frame[PCI_POS + 1];
+    }
+
+    static inline flow_status_t flow_status(const uint8_t *frame)
+    {
+        return (flow_status_t)(frame[PCI_POS] & 0x0F);
+    }
+
+    static inline uint8_t flow_block_size(const uint8_t *frame)
+    {
+        return frame[PCI_POS + 1];
+    }
+
+    static inline uint8_t flow_st_min(const uint8_t *frame)
+    {
+        return frame[PCI_POS + 2];
+    }
+
+private:
+    // fixed size fill, the compiler turns this into a single wide store
+    static inline void prepare(uint8_t *frame, uint8_t ta)
+    {
+        memset(frame, (uint8_t)PAD, DLC);
+        if (PCI_POS)
+        {
+            frame[0] = ta;
+        }
+    }
+
+    static constexpr uint8_t finish(uint8_t used)
+    {
+        return (PAD == NO_PADDING) ? used : DLC;
+    }
+};
+
+/* -------------------------------------------------------------------------- */
+/*                              Message reassembly                             */
+/* -------------------------------------------------------------------------- */
+// Rebuilds one direction of one conversation from received frames, without
+// sending flow control. Used for passive capture, so it works the same on
+// live frames and on frames replayed from a capture offline, and by the
+// endpoints, which send flow control themselves between feeds. Lengths and
+// sequence numbers are checked before anything is copied.
+
+enum class rx_status_t : uint8_t
+{
+    IDLE,        // no message in progress, frame ignored
+    IN_PROGRESS, // waiting for more consecutive frames
+    COMPLETE,    // dta holds a whole message of len bytes
+    ERROR,       // malformed frame or sequence gap, message dropped
+};
+
+template <typename CODEC>
+struct reassembler_t
+{
+    uint8_t dta[CODEC::MAX_LEN];
+    uint16_t len;   // bytes received so far
+    uint16_t total; // bytes announced by single / first frame
+    uint8_t sn;     // next expected sequence number
+
+    void reset()
+    {
+        len = 0;
+        total = 0;
+        sn = 0;
+    }
+
+    rx_status_t feed(const uint8_t *frame, uint8_t dlc)
+    {
+        uint8_t n;
+
+        switch (CODEC::type(frame))
+        {
+        case frame_type_t::SINGLE:
+            n = CODEC::single_len(frame);
+            if (n == 0 || n > CODEC::SF_DATA_MAX || CODEC::PCI_POS + 1 + n > dlc)
+            {
+                reset();
+                return rx_status_t::ERROR;
+            }
+            memcpy(dta, CODEC::single_dta(frame), n);
+            len = total = n;
+            return rx_status_t::COMPLETE;
+        case frame_type_t::FIRST:
+            total = CODEC::first_len(frame);
+            if (total <= CODEC::SF_DATA_MAX || total > CODEC::MAX_LEN || dlc < CODEC::FRAME_LEN)
+            {
+                reset();
+                return rx_status_t::ERROR;
+            }
+            memcpy(dta, CODEC::first_dta(frame), CODEC::FF_DATA_LEN);
+            len = CODEC::FF_DATA_LEN;
+            sn = 1;
+            return rx_status_t::IN_PROGRESS;
+        case frame_type_t::CONSECUTIVE:
+            if (len >= total)
+            {
+                // no first frame seen
+                return rx_status_t::IDLE;
+            }
+            n = CODEC::consecutive_len(total - len);
+            if (CODEC::consecutive_sn(frame) != sn || CODEC::PCI_POS + 1 + n > dlc)
+            {
+                reset();
+                return rx_status_t::ERROR;
+            }
+            memcpy(&dta[len], CODEC::consecutive_dta(frame), n);
+            len += n;
+            sn = (sn + 1) & 0x0F;
+            return (len == total) ? rx_status_t::COMPLETE : rx_status_t::IN_PROGRESS;
+        default:
+            // flow control belongs to the other direction
+            return (len < total) ? rx_status_t::IN_PROGRESS : rx_status_t::IDLE;
+        }
+    }
+};
+
+} // namespace isotp
+
+#endif // ISOTP_H
@@ -0,0 +1,32 @@
+#ifndef OBD_H
+#define OBD_H
+
+#include "driver/twai.h"
+#include "isotp.h"
+
+/* -------------------------------------------------------------------------- */
+/*                 Bus configuration shared by master and slave                */
+/* -------------------------------------------------------------------------- */
+// Both ends of the link must agree on everything here, so it lives in one
+// place instead of in each firmware.
+
+// bit timing and the bitrate reported to the host, change them together
+#define OBD_BITRATE 500000
+#define OBD_TIMING_CONFIG() TWAI_TIMING_CONFIG_500KBITS()
+
+// 11 bit identifiers
+#define ID_MASTER_REQ_DTA 0x7E0     // physical request to the slave
+#define ID_SLAVE_RESP_DTA 0x7E8     // response to a request
+#define ID_SLAVE_PERIODIC_DTA 0x6E8 // 0x2A periodic messages
+
+// legacy OBD services used next to UDS
+#define OBD_SVC_DTA 0x01
+#define OBD_DEV_RPM 0x0C
+#define OBD_DEV_SPD 0x0D
+#define OBD_SVC_INF 0x09
+#define OBD_INF_VIN 0x02
+
+// normal addressing, 0xAA padding, 8 byte frames, 12 bit length
+typedef isotp::codec_t<isotp::addressing_t::NORMAL, 0xAA, 8, isotp::MAX_FF_LEN> obd_tp_t;
+
+#endif // OBD_H
@@ -0,0 +1,54 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+/*                  Binary frame stream to a host (GVRET protocol)             */
+/* -------------------------------------------------------------------------- */
+// Frames leave the board in the GVRET binary format understood by SavvyCAN
+// and similar tools, batched into large writes on the native USB port
+// (USB-Serial-JTAG CDC-ACM). Linux host builds (CONFIG_IDF_TARGET_LINUX)
+// use a pty instead and print its path. Records are only sent once the host
+// has switched the link to binary mode (0xE7), as a GVRET device would.
+//
+// frame record: F1 00 TT TT TT TT II II II II (LEN | BUS << 4) DATA.. CRC
+// - timestamp in microseconds, identifier with bit 31 set if extended,
+//   both little endian
+// - CRC-8 (poly 0x07) over everything before it, in the byte GVRET
+//   reserves for a checksum
+
+// bus numbers, decoded values appear as extended frames on their own
+// virtual bus
+#define STREAM_BUS_CAN 0
+#define STREAM_BUS_DECODED 1
+
+// open the port and start the flush and host command tasks
+void stream_start(uint32_t bitrate, bool listen_only);
+
+// queue one frame record, waits a couple of flush periods for buffer space
+// and drops the record if the host still falls behind
+void stream_frame(
+    uint32_t ts,
+    uint32_t identifier,
+    bool extd,
+    uint8_t bus,
+    const uint8_t *dta,
+    uint8_t dlc);
+
+// queue a reassembled message as records of up to 8 bytes on the decoded
+// bus, each with an extended identifier: source identifier in bits 0-10,
+// chunk index in bits 16-24, bit 28 set on the last chunk
+void stream_message(
+    uint32_t ts,
+    uint32_t identifier,
+    const uint8_t *dta,
+    uint16_t len);
+
+// true once the host switched the link to binary mode
+bool stream_connected(void);
+
+// records dropped because the batch buffers were full or the port stalled
+uint32_t stream_dropped(void);
+
+#endif // STREAM_H
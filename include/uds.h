@@ -0,0 +1,62 @@
+#ifndef UDS_H
+#define UDS_H
+
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------- */
+/*                    UDS (ISO 14229) constants shared by both                  */
+/* -------------------------------------------------------------------------- */
+
+// services
+#define UDS_SVC_RDBI 0x22 // ReadDataByIdentifier
+#define UDS_SVC_RDBPI 0x2A // ReadDataByPeriodicIdentifier
+#define UDS_SVC_DDDI 0x2C // DynamicallyDefineDataIdentifier
+#define UDS_POS_RESP(S) ((S) | 0x40)
+#define UDS_NEG_RESP 0x7F
+
+// 0x2C sub-functions
+#define UDS_DDDI_DEFINE_BY_ID 0x01
+#define UDS_DDDI_CLEAR 0x03
+
+// 0x2A transmission modes
+#define UDS_RATE_SLOW 0x01
+#define UDS_RATE_MEDIUM 0x02
+#define UDS_RATE_FAST 0x03
+#define UDS_RATE_STOP 0x04
+
+// negative response codes
+#define UDS_NRC_SERVICE_NOT_SUPPORTED 0x11
+#define UDS_NRC_SUBFUNCTION_NOT_SUPPORTED 0x12
+#define UDS_NRC_INCORRECT_LENGTH 0x13
+#define UDS_NRC_RESPONSE_TOO_LONG 0x14
+#define UDS_NRC_REQUEST_OUT_OF_RANGE 0x31
+
+// data identifiers, OBD PIDs live at 0xF4xx (ISO 27145)
+#define UDS_DID_VIN 0xF190
+#define UDS_DID_RPM 0xF40C
+#define UDS_DID_SPD 0xF40D
+#define UDS_DID_DYN_FIRST 0xF200
+#define UDS_DID_DYN_LAST 0xF3FF
+#define UDS_DID_PERIODIC(P) (0xF200 | (P)) // periodic did from its low byte
+
+// periodic messages carry the periodic did byte and up to 7 data bytes
+// without PCI on their own identifier (ISO 15765-3 type 1)
+#define UDS_PERIODIC_DATA_MAX 7
+
+// largest request either side will build or accept
+#define UDS_MAX_REQ_LEN 64
+
+#define UDS_IS_DYN_DID(D) ((D) >= UDS_DID_DYN_FIRST && (D) <= UDS_DID_DYN_LAST)
+
+static inline uint16_t uds_get_did(const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static inline void uds_put_did(uint8_t *p, uint16_t did)
+{
+    p[0] = (did >> 8) & 0xFF;
+    p[1] = did & 0xFF;
+}
+
+#endif // UDS_H
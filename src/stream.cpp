@@ -0,0 +1,521 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include <string.h>
+#include "stream.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#include "esp_timer.h"
+#include "driver/usb_serial_jtag.h"
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*                      Definitions and static variables                      */
+/* -------------------------------------------------------------------------- */
+#define STREAM_TASK_PRIO 4
+#define STREAM_TAG "stream"
+
+#define STREAM_BATCH_LEN 2048 // bytes collected before a write
+#define STREAM_RECORD_MAX 20  // longest frame record
+#define STREAM_FLUSH_PERIOD (pdMS_TO_TICKS(10)) // longest a record waits
+
+// GVRET framing
+#define GVRET_START 0xF1
+#define GVRET_BINARY_MODE 0xE7
+#define GVRET_BUILD 0x0100 // reported firmware build
+#define GVRET_CMD_FRAME 0x00
+#define GVRET_CMD_TIME_SYNC 0x01
+#define GVRET_CMD_SET_DIG_OUTPUTS 0x03
+#define GVRET_CMD_SETUP_CANBUS 0x05
+#define GVRET_CMD_GET_CANBUS_PARAMS 0x06
+#define GVRET_CMD_GET_DEV_INFO 0x07
+#define GVRET_CMD_SET_SW_MODE 0x08
+#define GVRET_CMD_KEEPALIVE 0x09
+#define GVRET_CMD_SET_SYSTYPE 0x0A
+#define GVRET_CMD_ECHO_FRAME 0x0B
+#define GVRET_CMD_GET_NUMBUSES 0x0C
+#define GVRET_CMD_GET_EXT_BUSES 0x0D
+#define GVRET_CMD_SET_EXT_BUSES 0x0E
+
+typedef enum
+{
+    CMD_IDLE,
+    CMD_GET_COMMAND,
+    CMD_FRAME_HEADER, // ID ID ID ID BUS LEN of a frame we won't send
+    CMD_SKIP,
+} stream_cmd_state_t;
+
+// double buffered: producers fill batch[active], flush task writes the other
+static SemaphoreHandle_t stream_mut;
+static SemaphoreHandle_t stream_flush_sem;
+static SemaphoreHandle_t stream_space_sem; // given after every write
+static uint8_t batch[2][STREAM_BATCH_LEN];
+static uint16_t batch_len[2];
+static uint8_t active;
+
+static std::atomic<bool> binary_mode(false);
+static std::atomic<uint32_t> dropped(0);
+static uint32_t stream_bitrate;
+static bool stream_listen_only;
+
+/* -------------------------------------------------------------------------- */
+/*                                  Transport                                 */
+/* -------------------------------------------------------------------------- */
+
+#if !CONFIG_IDF_TARGET_LINUX
+
+static void port_open(void)
+{
+    usb_serial_jtag_driver_config_t cfg = {};
+    cfg.tx_buffer_size = STREAM_BATCH_LEN;
+    cfg.rx_buffer_size = 256;
+    ESP_ERROR_CHECK(usb_serial_jtag_driver_install(&cfg));
+    ESP_LOGI(STREAM_TAG, "stream on usb serial/jtag");
+}
+
+static int port_write(const uint8_t *dta, uint16_t len)
+{
+    return usb_serial_jtag_write_bytes(dta, len, STREAM_FLUSH_PERIOD);
+}
+
+static int port_read(uint8_t *dta, uint16_t len)
+{
+    return usb_serial_jtag_read_bytes(dta, len, portMAX_DELAY);
+}
+
+static uint32_t port_time(void)
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+#else
+
+// linux host build: point the CAN tool at the printed pty. The FreeRTOS
+// POSIX port runs one task at a time, so nothing here may block in a system
+// call, waits go through vTaskDelay instead
+static int port_fd = -1;
+
+static void port_open(void)
+{
+    struct termios tio;
+
+    port_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (port_fd < 0 || grantpt(port_fd) || unlockpt(port_fd))
+    {
+        ESP_LOGE(STREAM_TAG, "failed to open pty!");
+        abort();
+    }
+    tcgetattr(port_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(port_fd, TCSANOW, &tio);
+    ESP_LOGI(STREAM_TAG, "stream on %s", ptsname(port_fd));
+}
+
+static int port_write(const uint8_t *dta, uint16_t len)
+{
+    TickType_t start = xTaskGetTickCount();
+    uint16_t done = 0;
+    ssize_t n;
+
+    // give a slow reader one flush period, like the usb driver's timeout
+    while (done < len)
+    {
+        n = write(port_fd, &dta[done], len - done);
+        if (n > 0)
+        {
+            done += n;
+            continue;
+        }
+        if (xTaskGetTickCount() - start >= STREAM_FLUSH_PERIOD)
+        {
+            break;
+        }
+        vTaskDelay(1);
+    }
+    return done;
+}
+
+static int port_read(uint8_t *dta, uint16_t len)
+{
+    ssize_t n = read(port_fd, dta, len);
+
+    if (n <= 0)
+    {
+        // nothing yet, or no reader has the pty open
+        vTaskDelay(STREAM_FLUSH_PERIOD);
+        return 0;
+    }
+    return (int)n;
+}
+
+static uint32_t port_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)(now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+}
+
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*                             Tasks and functions                            */
+/* -------------------------------------------------------------------------- */
+
+static uint8_t stream_crc8(const uint8_t *dta, uint16_t len)
+{
+    uint8_t crc = 0;
+    for (uint16_t i = 0; i < len; i++)
+    {
+        crc ^= dta[i];
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+// length of a record this module builds, from its command and frame header
+static uint16_t record_len(const uint8_t *rec)
+{
+    switch (rec[1])
+    {
+    case GVRET_CMD_FRAME:
+        return 12 + (rec[10] & 0x0F);
+    case GVRET_CMD_TIME_SYNC:
+        return 6;
+    case GVRET_CMD_GET_CANBUS_PARAMS:
+        return 12;
+    case GVRET_CMD_GET_DEV_INFO:
+        return 8;
+    case GVRET_CMD_KEEPALIVE:
+        return 4;
+    case GVRET_CMD_GET_NUMBUSES:
+        return 3;
+    case GVRET_CMD_GET_EXT_BUSES:
+        return 17;
+    default:
+        return 2;
+    }
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+// copy a record into the active batch, waiting a couple of flush periods
+// for room so bursts back up into the caller's buffers first
+static bool stream_append(const uint8_t *rec, uint16_t len)
+{
+    bool ok = false;
+    bool full;
+
+    for (int attempt = 0; attempt < 3 && !ok; attempt++)
+    {
+        if (attempt)
+        {
+            xSemaphoreTake(stream_space_sem, STREAM_FLUSH_PERIOD);
+        }
+
+        xSemaphoreTake(stream_mut, portMAX_DELAY);
+        ok = batch_len[active] + len <= STREAM_BATCH_LEN;
+        if (ok)
+        {
+            memcpy(&batch[active][batch_len[active]], rec, len);
+            batch_len[active] += len;
+        }
+        full = batch_len[active] > STREAM_BATCH_LEN - STREAM_RECORD_MAX;
+        xSemaphoreGive(stream_mut);
+
+        // don't wait for the flush period once the batch is nearly full
+        if (full)
+        {
+            xSemaphoreGive(stream_flush_sem);
+        }
+    }
+    return ok;
+}
+
+void stream_frame(
+    uint32_t ts,
+    uint32_t identifier,
+    bool extd,
+    uint8_t bus,
+    const uint8_t *dta,
+    uint8_t dlc)
+{
+    uint8_t rec[STREAM_RECORD_MAX];
+
+    if (!binary_mode.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    dlc = (dlc > 8) ? 8 : dlc;
+    rec[0] = GVRET_START;
+    rec[1] = GVRET_CMD_FRAME;
+    put_u32(&rec[2], ts);
+    put_u32(&rec[6], identifier | (extd ? (1UL << 31) : 0));
+    rec[10] = dlc | (bus << 4);
+    memcpy(&rec[11], dta, dlc);
+    rec[11 + dlc] = stream_crc8(rec, 11 + dlc);
+
+    if (!stream_append(rec, 12 + dlc))
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void stream_message(
+    uint32_t ts,
+    uint32_t identifier,
+    const uint8_t *dta,
+    uint16_t len)
+{
+    uint16_t chunk = 0;
+    uint8_t n;
+
+    for (uint16_t pos = 0; pos < len; pos += n, chunk++)
+    {
+        n = (len - pos > 8) ? 8 : (uint8_t)(len - pos);
+        stream_frame(
+            ts,
+            (identifier & 0x7FF) |
+                ((uint32_t)chunk << 16) |
+                ((pos + n == len) ? (1UL << 28) : 0),
+            true,
+            STREAM_BUS_DECODED,
+            &dta[pos],
+            n);
+    }
+}
+
+bool stream_connected(void)
+{
+    return binary_mode.load(std::memory_order_relaxed);
+}
+
+uint32_t stream_dropped(void)
+{
+    return dropped.load(std::memory_order_relaxed);
+}
+
+// write a batch, finishing a record the port cut short so the host parser
+// stays in sync, and count the records that never left as dropped
+static void stream_write(const uint8_t *dta, uint16_t len)
+{
+    int n = port_write(dta, len);
+    uint16_t done = (n > 0) ? n : 0;
+    uint16_t end = 0;
+    uint32_t lost = 0;
+
+    if (done == len)
+    {
+        return;
+    }
+
+    // end of the record the write stopped in
+    while (end < done)
+    {
+        end += record_len(&dta[end]);
+    }
+    if (end > done)
+    {
+        n = port_write(&dta[done], end - done);
+        if (n != end - done)
+        {
+            lost++;
+        }
+    }
+
+    for (; end < len; end += record_len(&dta[end]))
+    {
+        lost++;
+    }
+    dropped.fetch_add(lost, std::memory_order_relaxed);
+}
+
+// write out whatever accumulated, at least every flush period
+static void stream_flush_task(void *arg)
+{
+    uint8_t idx;
+
+    for (;;)
+    {
+        xSemaphoreTake(stream_flush_sem, STREAM_FLUSH_PERIOD);
+
+        xSemaphoreTake(stream_mut, portMAX_DELAY);
+        idx = active;
+        if (batch_len[idx])
+        {
+            active ^= 1;
+        }
+        xSemaphoreGive(stream_mut);
+
+        if (!batch_len[idx])
+        {
+            continue;
+        }
+        stream_write(batch[idx], batch_len[idx]);
+        batch_len[idx] = 0;
+        xSemaphoreGive(stream_space_sem);
+    }
+}
+
+// answer the GVRET commands a host tool uses to set up the link, record
+// lengths live in record_len
+static void stream_reply(uint8_t cmd)
+{
+    uint8_t rec[STREAM_RECORD_MAX] = {GVRET_START, cmd};
+
+    switch (cmd)
+    {
+    case GVRET_CMD_TIME_SYNC:
+        put_u32(&rec[2], port_time());
+        break;
+    case GVRET_CMD_GET_CANBUS_PARAMS:
+        // enabled | listen only << 4, then bitrate; bus 1 is receive only
+        rec[2] = 0x01 | (stream_listen_only ? 0x10 : 0x00);
+        put_u32(&rec[3], stream_bitrate);
+        rec[7] = 0x11;
+        put_u32(&rec[8], stream_bitrate);
+        break;
+    case GVRET_CMD_GET_DEV_INFO:
+        rec[2] = GVRET_BUILD & 0xFF;
+        rec[3] = (GVRET_BUILD >> 8) & 0xFF;
+        rec[4] = 0x20; // eeprom version
+        break;
+    case GVRET_CMD_KEEPALIVE:
+        rec[2] = 0xDE;
+        rec[3] = 0xAD;
+        break;
+    case GVRET_CMD_GET_NUMBUSES:
+        rec[2] = 2;
+        break;
+    case GVRET_CMD_GET_EXT_BUSES:
+        break;
+    default:
+        return;
+    }
+
+    stream_append(rec, record_len(rec));
+    xSemaphoreGive(stream_flush_sem);
+}
+
+static void stream_cmd_task(void *arg)
+{
+    uint8_t buf[64];
+    stream_cmd_state_t state = CMD_IDLE;
+    uint16_t skip = 0; // bytes left to ignore
+    uint8_t c;
+    int n;
+
+    for (;;)
+    {
+        n = port_read(buf, sizeof(buf));
+        for (int i = 0; i < n; i++)
+        {
+            c = buf[i];
+            switch (state)
+            {
+            case CMD_IDLE:
+                if (c == GVRET_BINARY_MODE)
+                {
+                    binary_mode.store(true, std::memory_order_relaxed);
+                }
+                else if (c == GVRET_START)
+                {
+                    state = CMD_GET_COMMAND;
+                }
+                break;
+            case CMD_GET_COMMAND:
+                // commands that carry parameters we don't act on
+                state = CMD_SKIP;
+                switch (c)
+                {
+                case GVRET_CMD_FRAME:
+                case GVRET_CMD_ECHO_FRAME:
+                    state = CMD_FRAME_HEADER;
+                    skip = 6;
+                    break;
+                case GVRET_CMD_SETUP_CANBUS:
+                    skip = 8;
+                    break;
+                case GVRET_CMD_SET_EXT_BUSES:
+                    skip = 12;
+                    break;
+                case GVRET_CMD_SET_DIG_OUTPUTS:
+                case GVRET_CMD_SET_SW_MODE:
+                case GVRET_CMD_SET_SYSTYPE:
+                    skip = 1;
+                    break;
+                default:
+                    stream_reply(c);
+                    state = CMD_IDLE;
+                    break;
+                }
+                break;
+            case CMD_FRAME_HEADER:
+                // last header byte is the data length, a checksum follows
+                if (--skip == 0)
+                {
+                    skip = (c & 0x0F) + 1;
+                    state = CMD_SKIP;
+                }
+                break;
+            case CMD_SKIP:
+                if (--skip == 0)
+                {
+                    state = CMD_IDLE;
+                }
+                break;
+            }
+        }
+    }
+}
+
+void stream_start(uint32_t bitrate, bool listen_only)
+{
+    stream_bitrate = bitrate;
+    stream_listen_only = listen_only;
+    stream_mut = xSemaphoreCreateMutex();
+    stream_flush_sem = xSemaphoreCreateBinary();
+    stream_space_sem = xSemaphoreCreateBinary();
+
+    port_open();
+
+    xTaskCreatePinnedToCore(
+        stream_flush_task,
+        "stream_flush",
+        4096,
+        NULL,
+        STREAM_TASK_PRIO,
+        NULL,
+        tskNO_AFFINITY);
+
+    xTaskCreatePinnedToCore(
+        stream_cmd_task,
+        "stream_cmd",
+        4096,
+        NULL,
+        STREAM_TASK_PRIO,
+        NULL,
+        tskNO_AFFINITY);
+}
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_idf_version.h"
+#include "driver/twai.h"
+#include <string.h>
+#include "isotp.h"
+#include "stream.h"
+
+/* -------------------------------------------------------------------------- */
+/*                      Definitions and static variables                      */
+/* -------------------------------------------------------------------------- */
+#ifndef MIN
+#define MIN(a, b) ((a) > (b) ? (b) : (a))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define CAPTURE_TASK_PRIO 12
+#define DECODE_TASK_PRIO 6
+#define STATS_TASK_PRIO 5
+#define CAPTURE_TASK_CORE 1
+#define TX_GPIO_NUM GPIO_NUM_5
+#define RX_GPIO_NUM GPIO_NUM_16
+#define CAPTURE_TAG "capture_task"
+#define DECODE_TAG "decode_task"
+#define STATS_TAG "stats_task"
+#define MAIN_TAG "bus capture"
+#define CAPTURE_BITRATE 500000
+
+// a fully loaded 500 kbit/s bus carries roughly 4000 frames/s, the ring
+// holds about a second of that for the decoder to catch up from
+#define CAPTURE_RING_LEN 4096 // power of two
+#define CAPTURE_DRIVER_QUEUE_LEN 64
+#define CAPTURE_SESSIONS 8 // conversations reassembled at once
+#define CAPTURE_DIAG_ID_FIRST 0x7DF // 11 bit functional and physical
+#define CAPTURE_DIAG_ID_LAST 0x7EF  // diagnostic request / response ids
+#define DECODE_IDLE_DELAY (pdMS_TO_TICKS(10))
+#define STATS_PERIOD (pdMS_TO_TICKS(5000))
+
+// normal addressing, padded or unpadded frames, payloads up to the ISO-TP limit
+typedef isotp::codec_t<isotp::addressing_t::NORMAL, isotp::NO_PADDING, 8, isotp::MAX_FF_LEN> capture_tp_t;
+
+typedef struct
+{
+    uint32_t ts; // microseconds since boot when dequeued, wraps after ~71 min
+    uint32_t identifier;
+    uint8_t flags; // twai_message_t flags (extd, rtr, ...)
+    uint8_t dlc;
+    uint8_t data[8];
+} capture_frame_t;
+
+typedef struct
+{
+    uint32_t identifier;
+    uint32_t last_ts; // for evicting the stalest session
+    bool used;
+    isotp::reassembler_t<capture_tp_t> rx;
+} capture_session_t;
+
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_500KBITS();
+static const twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+
+static SemaphoreHandle_t capture_task_sem;
+
+// single producer (capture task), single consumer (decode task)
+static capture_frame_t ring[CAPTURE_RING_LEN];
+static std::atomic<uint32_t> ring_head(0); // next slot written
+static std::atomic<uint32_t> ring_tail(0); // next slot read
+
+static capture_session_t sessions[CAPTURE_SESSIONS];
+
+// counters reported by the stats task
+static std::atomic<uint32_t> frames_captured(0);
+static std::atomic<uint32_t> frames_dropped(0); // ring full
+static std::atomic<uint32_t> messages_decoded(0);
+static std::atomic<uint32_t> decode_errors(0);
+
+/* -------------------------------------------------------------------------- */
+/*                             Tasks and functions                            */
+/* -------------------------------------------------------------------------- */
+
+// drain the driver as fast as possible, nothing else happens on this path.
+// The legacy driver keeps no receive time, so frames are stamped when they
+// leave its queue: frames that queued up while this task was delayed get
+// timestamps bunched together instead of their arrival times.
+static void capture_task(void *arg)
+{
+    xSemaphoreTake(capture_task_sem, portMAX_DELAY);
+    twai_message_t inc_msg;
+    capture_frame_t *f;
+    uint32_t head;
+    uint32_t ts;
+
+    ESP_ERROR_CHECK(twai_start());
+    ESP_LOGI(CAPTURE_TAG, "capture started (listen only)");
+
+    for (;;)
+    {
+        if (twai_receive(&inc_msg, portMAX_DELAY) != ESP_OK)
+        {
+            continue;
+        }
+        ts = (uint32_t)esp_timer_get_time();
+
+        head = ring_head.load(std::memory_order_relaxed);
+        if (head - ring_tail.load(std::memory_order_acquire) >= CAPTURE_RING_LEN)
+        {
+            frames_dropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        f = &ring[head & (CAPTURE_RING_LEN - 1)];
+        f->ts = ts;
+        f->identifier = inc_msg.identifier;
+        f->flags = (uint8_t)inc_msg.flags;
+        f->dlc = MIN(inc_msg.data_length_code, 8);
+        memcpy(f->data, inc_msg.data, 8);
+        ring_head.store(head + 1, std::memory_order_release);
+
+        frames_captured.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static capture_session_t *session_find(uint32_t identifier, uint32_t ts)
+{
+    capture_session_t *stale = &sessions[0];
+
+    for (int i = 0; i < CAPTURE_SESSIONS; i++)
+    {
+        if (sessions[i].used && sessions[i].identifier == identifier)
+        {
+            return &sessions[i];
+        }
+        if (!sessions[i].used)
+        {
+            stale = &sessions[i];
+        }
+        else if (stale->used && ts - sessions[i].last_ts > ts - stale->last_ts)
+        {
+            stale = &sessions[i];
+        }
+    }
+
+    // take a free slot, or evict the conversation quiet for longest
+    stale->used = true;
+    stale->identifier = identifier;
+    stale->rx.reset();
+    return stale;
+}
+
+// forward captured frames to the host and reassemble ISO-TP messages per
+// identifier, forwarding complete messages on the decoded bus
+static void decode_task(void *arg)
+{
+    capture_frame_t *f;
+    capture_session_t *s;
+    uint32_t tail;
+
+    for (;;)
+    {
+        tail = ring_tail.load(std::memory_order_relaxed);
+        if (tail == ring_head.load(std::memory_order_acquire))
+        {
+            vTaskDelay(DECODE_IDLE_DELAY);
+            continue;
+        }
+
+        f = &ring[tail & (CAPTURE_RING_LEN - 1)];
+        stream_frame(
+            f->ts,
+            f->identifier,
+            f->flags & TWAI_MSG_FLAG_EXTD,
+            STREAM_BUS_CAN,
+            f->data,
+            f->dlc);
+
+        if (!(f->flags & (TWAI_MSG_FLAG_EXTD | TWAI_MSG_FLAG_RTR)) &&
+            f->identifier >= CAPTURE_DIAG_ID_FIRST &&
+            f->identifier <= CAPTURE_DIAG_ID_LAST)
+        {
+            s = session_find(f->identifier, f->ts);
+            s->last_ts = f->ts;
+            switch (s->rx.feed(f->data, f->dlc))
+            {
+            case isotp::rx_status_t::COMPLETE:
+                messages_decoded.fetch_add(1, std::memory_order_relaxed);
+                stream_message(f->ts, f->identifier, s->rx.dta, s->rx.len);
+                ESP_LOGD(
+                    DECODE_TAG,
+                    "%lu us %03lx: %d bytes, service %02x",
+                    (unsigned long)f->ts,
+                    (unsigned long)f->identifier,
+                    s->rx.len,
+                    s->rx.dta[0]);
+                break;
+            case isotp::rx_status_t::ERROR:
+                decode_errors.fetch_add(1, std::memory_order_relaxed);
+                break;
+            default:
+                break;
+            }
+        }
+
+        ring_tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+// report how complete the capture is
+static void stats_task(void *arg)
+{
+    twai_status_info_t status;
+
+    TickType_t x_last_wake_time;
+    const TickType_t x_period = STATS_PERIOD;
+    x_last_wake_time = xTaskGetTickCount();
+
+    for (;;)
+    {
+        vTaskDelayUntil(&x_last_wake_time, x_period);
+        if (twai_get_status_info(&status) != ESP_OK)
+        {
+            continue;
+        }
+
+        ESP_LOGI(
+            STATS_TAG,
+            "frames: %lu; ring dropped: %lu; stream dropped: %lu; messages: %lu; decode errors: %lu",
+            (unsigned long)frames_captured.load(),
+            (unsigned long)frames_dropped.load(),
+            (unsigned long)stream_dropped(),
+            (unsigned long)messages_decoded.load(),
+            (unsigned long)decode_errors.load());
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+        ESP_LOGI(
+            STATS_TAG,
+            "driver missed: %lu; hw overrun: %lu",
+            (unsigned long)status.rx_missed_count,
+            (unsigned long)status.rx_overrun_count);
+#else
+        ESP_LOGI(
+            STATS_TAG,
+            "driver missed: %lu",
+            (unsigned long)status.rx_missed_count);
+#endif
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                              Application main                              */
+/* -------------------------------------------------------------------------- */
+
+extern "C" void app_main(void)
+{
+    // listen only: never ack or transmit, safe next to a live tester
+    twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(
+        TX_GPIO_NUM,
+        RX_GPIO_NUM,
+        TWAI_MODE_LISTEN_ONLY);
+    g_config.rx_queue_len = CAPTURE_DRIVER_QUEUE_LEN;
+
+    // short bootup delay to get debug serial connected
+    for (int i = 3; i > 0; i--)
+    {
+        ESP_LOGI(MAIN_TAG, "starting in %d", i);
+        vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+
+    // check for drivers correctly installed
+    ESP_ERROR_CHECK(twai_driver_install(&g_config, &t_config, &f_config));
+    ESP_LOGI(MAIN_TAG, "TWAI driver started");
+
+    capture_task_sem = xSemaphoreCreateBinary();
+    stream_start(CAPTURE_BITRATE, true);
+
+    ESP_LOGI(MAIN_TAG, "starting tasks");
+
+    // keep the capture path on its own core away from logging
+    xTaskCreatePinnedToCore(
+        capture_task,
+        "capture_task",
+        4096,
+        NULL,
+        CAPTURE_TASK_PRIO,
+        NULL,
+        CAPTURE_TASK_CORE);
+
+    xTaskCreatePinnedToCore(
+        decode_task,
+        "decode_task",
+        8192,
+        NULL,
+        DECODE_TASK_PRIO,
+        NULL,
+        tskNO_AFFINITY);
+
+    xTaskCreatePinnedToCore(
+        stats_task,
+        "stats_task",
+        4096,
+        NULL,
+        STATS_TASK_PRIO,
+        NULL,
+        tskNO_AFFINITY);
+
+    // start capture
+    xSemaphoreGive(capture_task_sem);
+
+    // tasks running, return
+    return;
+}
@@ -8,6 +8,11 @@
 #include "esp_log.h"
 #include "driver/twai.h"
 #include <string.h>
+#include "isotp.h"
+#include "obd.h"
+#include "uds.h"
+#include "stream.h"
+#include "esp_timer.h"
 /* -------------------------------------------------------------------------- */
 /*                      Definitions and static variables                      */
 /* -------------------------------------------------------------------------- */
@@ -21,38 +26,30 @@
 
 #define OBD_TASK_PRIO 8
 #define CTRL_TASK_PRIO 10
+#define RX_TASK_PRIO 11
 #define TX_GPIO_NUM GPIO_NUM_5
 #define RX_GPIO_NUM GPIO_NUM_16
 #define CTRL_TAG "twai_task"
+#define RX_TAG "rx_task"
 #define MAIN_TAG "fake obd device"
 #define VIN_TAG "vin_task"
-#define RPM_TAG "rpm_task"
-#define SPEED_TAG "speed_task"
-
-#define ID_MASTER_REQ_DTA 0x7E0
-#define ID_SLAVE_RESP_DTA 0x7E8
-#define OBD_SVC_DTA 0x01
-#define OBD_DEV_RPM 0x0C
-#define OBD_DEV_SPD 0x0D
-#define OBD_SVC_INF 0x09
-#define OBD_INF_VIN 0x02
+#define SIGNAL_TAG "signal_task"
 
 #define VIN_PERIOD (pdMS_TO_TICKS(10000))
-#define SPEED_PERIOD (pdMS_TO_TICKS(1000));
-#define RPM_PERIOD (pdMS_TO_TICKS(2000));
-#define OBD_FRAME_SINGLE (0x00)
-#define OBD_FRAME_FIRST (0x01)
-#define OBD_FRAME_CONS (0x02)
-#define OBD_FRAME_FLOW (0x03)
+#define SIGNAL_PERIOD (pdMS_TO_TICKS(1000));
+#define SIGNAL_TIMEOUT (pdMS_TO_TICKS(5000)) // longest gap in periodic data
+#define SIGNAL_SUBSCRIBE_BACKOFF 30 // polls before retrying a rejected subscription
+#define RESP_QUEUE_TIMEOUT (pdMS_TO_TICKS(10)) // longest the rx task waits on the control task
 #define OBD_CONSEC_DELAY (0x0A)
 #define OBD_CONSEC_COUNT (0x05)
 
-#define MSB_NIBBLE(A) ((A >> 4) & 0x0F)
-#define LSB_NIBBLE(A) ((A) & 0x0F)
+#define LSB_BYTE(A) ((A) & 0xFF)
 
 typedef enum
 {
     TX_SEND_REQ,
+    RX_RECV_SLAVE_FLOW,
+    TX_SEND_CONS,
     RX_RECV_SLAVE_SNGL_FRST,
     TX_SEND_FLOW,
     RX_RECV_SLAVE_CONS,
@@ -67,26 +64,54 @@ typedef struct
     uint16_t max_len;
 
     // transmission to VMCU
-    uint8_t service; // service 0x01 - 0x09
-    uint8_t s_id; // service ID depends on availability of services
+    uint8_t req[UDS_MAX_REQ_LEN]; // service followed by its parameters
+    uint16_t req_len;
 
     // task control
     SemaphoreHandle_t *sem;
 } obd_transaction_t;
 
+typedef struct
+{
+    uint16_t did;
+    uint8_t size;
+    const char *name;
+    uint8_t rate; // 0x2A transmission mode
+} obd_signal_t;
+
+// how the signal task gets its signals, best first
+typedef enum
+{
+    SIGNAL_PERIODIC,       // slave pushes every rate did
+    SIGNAL_POLL_COMPOSITE, // rate dids defined, read them all in one 0x22
+    SIGNAL_POLL_DIDS,      // no dynamic dids, list every signal did in 0x22
+} signal_mode_t;
+
+// signals streamed to the signal task, in composite did order per rate
+static const obd_signal_t signals[] = {
+    {UDS_DID_RPM, 2, "rpm", UDS_RATE_FAST},
+    {UDS_DID_SPD, 1, "speed", UDS_RATE_MEDIUM},
+};
+#define SIGNAL_COUNT ((int)(sizeof(signals) / sizeof(signals[0])))
+
 static const twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(
     TX_GPIO_NUM,
     RX_GPIO_NUM,
     TWAI_MODE_NORMAL);
 
-static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_500KBITS();
+static const twai_timing_config_t t_config = OBD_TIMING_CONFIG();
 static const twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
 static SemaphoreHandle_t twai_task_sem;
 static SemaphoreHandle_t vin_task_sem;
-static SemaphoreHandle_t rpm_task_sem;
-static SemaphoreHandle_t speed_task_sem;
+static SemaphoreHandle_t signal_task_sem;
+static SemaphoreHandle_t twai_rx_task_sem;
+static SemaphoreHandle_t periodic_route_mut;
 
 static QueueHandle_t obd_trans_queue;
+static QueueHandle_t twai_resp_queue; // response frames for the control task
+static QueueHandle_t signal_queue;    // periodic messages for the signal task
+static QueueHandle_t periodic_routes[256]; // consumer by periodic did
+static uint32_t resp_dropped; // response frames nobody was waiting for
 
 /* -------------------------------------------------------------------------- */
 /*                             Tasks and functions                            */
@@ -127,8 +152,9 @@ static void vin_task(void *arg)
         out_trans.dta = dta;
         out_trans.dta_len = &dta_len;
         out_trans.max_len = 256;
-        out_trans.service = OBD_SVC_INF;
-        out_trans.s_id = OBD_INF_VIN;
+        out_trans.req[0] = OBD_SVC_INF;
+        out_trans.req[1] = OBD_INF_VIN;
+        out_trans.req_len = 2;
         out_trans.sem = &vin_task_sem;
         
         // hand request to twai task
@@ -141,72 +167,341 @@ static void vin_task(void *arg)
     }
 }
 
-static void speed_task(void *arg)
+// hand a request to the twai task and block until the response is written
+static void obd_transact(obd_transaction_t *t)
 {
-    xSemaphoreTake(speed_task_sem, portMAX_DELAY);
-    ESP_LOGI(VIN_TAG, "speed task started");
-    obd_transaction_t out_trans;
-    uint8_t dta[256];
-    uint16_t dta_len;
+    xQueueSend(obd_trans_queue, t, portMAX_DELAY);
+    xSemaphoreTake(*t->sem, portMAX_DELAY);
+}
 
+// send periodic messages with this periodic did to queue, NULL to stop
+static void periodic_route(uint8_t pdid, QueueHandle_t queue)
+{
+    xSemaphoreTake(periodic_route_mut, portMAX_DELAY);
+    periodic_routes[pdid] = queue;
+    xSemaphoreGive(periodic_route_mut);
+}
 
-    TickType_t x_last_wake_time;
-    const TickType_t x_period = SPEED_PERIOD;
-    x_last_wake_time = xTaskGetTickCount();
+// stop every periodic did signal_subscribe may have started: 2A 04 PP...
+static void signal_unsubscribe(obd_transaction_t *t)
+{
+    t->req[0] = UDS_SVC_RDBPI;
+    t->req[1] = UDS_RATE_STOP;
+    t->req_len = 2;
+    for (uint8_t rate = UDS_RATE_SLOW; rate <= UDS_RATE_FAST; rate++)
+    {
+        periodic_route(LSB_BYTE(UDS_DID_PERIODIC(rate)), NULL);
+        t->req[t->req_len++] = LSB_BYTE(UDS_DID_PERIODIC(rate));
+    }
+    obd_transact(t);
+}
 
-    for (;;)
+// true if any signal is wanted at this rate, only those rates get a did
+static bool signal_rate_used(uint8_t rate)
+{
+    for (int i = 0; i < SIGNAL_COUNT; i++)
     {
-        vTaskDelayUntil(&x_last_wake_time, x_period);
+        if (signals[i].rate == rate)
+        {
+            return true;
+        }
+    }
+    return false;
+}
 
-        // generate transaction
-        out_trans.dta = dta;
-        out_trans.dta_len = &dta_len;
-        out_trans.max_len = 256;
-        out_trans.service = OBD_SVC_DTA;
-        out_trans.s_id = OBD_DEV_SPD;
-        out_trans.sem = &speed_task_sem;
-        
-        // hand request to twai task
-        xQueueSend(obd_trans_queue, &out_trans, portMAX_DELAY);
-        xSemaphoreTake(speed_task_sem, portMAX_DELAY);
+// define one dynamic did per rate holding that rate's signals and subscribe
+// to each of them, returns how far the slave went along
+static signal_mode_t signal_subscribe(obd_transaction_t *t, QueueHandle_t queue)
+{
+    uint16_t did;
 
-        // log output (process in real task)
-        ESP_LOGI(SPEED_TAG, "Received data: ");
-        esp_log_buffer(SPEED_TAG, dta, dta_len);
+    for (uint8_t rate = UDS_RATE_SLOW; rate <= UDS_RATE_FAST; rate++)
+    {
+        if (!signal_rate_used(rate))
+        {
+            continue;
+        }
+        did = UDS_DID_PERIODIC(rate);
+
+        // 2C 03 DD DD, clear first so a retry doesn't append
+        t->req[0] = UDS_SVC_DDDI;
+        t->req[1] = UDS_DDDI_CLEAR;
+        uds_put_did(&t->req[2], did);
+        t->req_len = 4;
+        obd_transact(t);
+
+        // 2C 01 DD DD (SS SS PP LL)...
+        t->req[1] = UDS_DDDI_DEFINE_BY_ID;
+        t->req_len = 4;
+        for (int i = 0; i < SIGNAL_COUNT; i++)
+        {
+            if (signals[i].rate != rate)
+            {
+                continue;
+            }
+            uds_put_did(&t->req[t->req_len], signals[i].did);
+            t->req[t->req_len + 2] = 1;
+            t->req[t->req_len + 3] = signals[i].size;
+            t->req_len += 4;
+        }
+        obd_transact(t);
+        if (*t->dta_len < 1 || t->dta[0] != UDS_POS_RESP(UDS_SVC_DDDI))
+        {
+            ESP_LOGE(SIGNAL_TAG, "did %04x rejected", did);
+            return SIGNAL_POLL_DIDS;
+        }
     }
+
+    for (uint8_t rate = UDS_RATE_SLOW; rate <= UDS_RATE_FAST; rate++)
+    {
+        if (!signal_rate_used(rate))
+        {
+            continue;
+        }
+        did = UDS_DID_PERIODIC(rate);
+
+        // 2A MM PP
+        periodic_route(LSB_BYTE(did), queue);
+        t->req[0] = UDS_SVC_RDBPI;
+        t->req[1] = rate;
+        t->req[2] = LSB_BYTE(did);
+        t->req_len = 3;
+        obd_transact(t);
+        if (*t->dta_len < 1 || t->dta[0] != UDS_POS_RESP(UDS_SVC_RDBPI))
+        {
+            ESP_LOGE(SIGNAL_TAG, "periodic did %02x rejected", LSB_BYTE(did));
+            periodic_route(LSB_BYTE(did), NULL);
+            return SIGNAL_POLL_COMPOSITE;
+        }
+        ESP_LOGI(SIGNAL_TAG, "subscribed did %04x at rate %d", did, rate);
+    }
+    return SIGNAL_PERIODIC;
 }
 
-static void rpm_task(void *arg)
+// log a decoded signal and stream it to the host as a frame on the decoded
+// bus, with the did as extended identifier since dids don't fit in 11 bits
+static void signal_log(int i, const uint8_t *dta)
 {
-    xSemaphoreTake(rpm_task_sem, portMAX_DELAY);
-    ESP_LOGI(RPM_TAG, "rpm task started");
+    uint32_t val = 0;
+
+    stream_frame(
+        (uint32_t)esp_timer_get_time(),
+        signals[i].did,
+        true,
+        STREAM_BUS_DECODED,
+        dta,
+        signals[i].size);
+
+    for (int j = 0; j < signals[i].size; j++)
+    {
+        val = (val << 8) | dta[j];
+    }
+    ESP_LOGD(SIGNAL_TAG, "%s: %lu", signals[i].name, (unsigned long)val);
+}
+
+static void signal_task(void *arg)
+{
+    xSemaphoreTake(signal_task_sem, portMAX_DELAY);
+    ESP_LOGI(SIGNAL_TAG, "signal task started");
     obd_transaction_t out_trans;
+    twai_message_t msg;
     uint8_t dta[256];
     uint16_t dta_len;
+    signal_mode_t mode = SIGNAL_POLL_DIDS;
+    int backoff = 0; // polls left before trying to subscribe again
+    uint16_t pos;
 
     TickType_t x_last_wake_time;
-    const TickType_t x_period = RPM_PERIOD;
+    const TickType_t x_period = SIGNAL_PERIOD;
     x_last_wake_time = xTaskGetTickCount();
 
+    out_trans.dta = dta;
+    out_trans.dta_len = &dta_len;
+    out_trans.max_len = 256;
+    out_trans.sem = &signal_task_sem;
+
     for (;;)
     {
+        if (mode == SIGNAL_PERIODIC)
+        {
+            // PP (signal...), signals in the same order as defined
+            if (xQueueReceive(signal_queue, &msg, SIGNAL_TIMEOUT) != pdTRUE)
+            {
+                // slave may have reset and lost the subscription
+                ESP_LOGE(SIGNAL_TAG, "periodic data stopped");
+                mode = SIGNAL_POLL_DIDS;
+
+                // periods spent subscribed are not owed to the poll loop
+                x_last_wake_time = xTaskGetTickCount();
+                continue;
+            }
+            pos = 1;
+            for (int i = 0; i < SIGNAL_COUNT; i++)
+            {
+                // each rate has its own did with periodic did byte == rate
+                if (msg.data[0] != signals[i].rate)
+                {
+                    continue;
+                }
+                if (pos + signals[i].size > msg.data_length_code)
+                {
+                    ESP_LOGE(SIGNAL_TAG, "periodic message too short");
+                    break;
+                }
+                signal_log(i, &msg.data[pos]);
+                pos += signals[i].size;
+            }
+            continue;
+        }
+
         vTaskDelayUntil(&x_last_wake_time, x_period);
+        if (backoff-- <= 0)
+        {
+            mode = signal_subscribe(&out_trans, signal_queue);
+            if (mode == SIGNAL_PERIODIC)
+            {
+                continue;
+            }
 
-        // generate transaction
-        out_trans.dta = dta;
-        out_trans.dta_len = &dta_len;
-        out_trans.max_len = 256;
-        out_trans.service = OBD_SVC_DTA;
-        out_trans.s_id = OBD_DEV_RPM;
-        out_trans.sem = &rpm_task_sem;
-        
-        // hand request to twai task
-        xQueueSend(obd_trans_queue, &out_trans, portMAX_DELAY);
-        xSemaphoreTake(rpm_task_sem, portMAX_DELAY);
+            // don't leave rates that were accepted filling the queue, and
+            // keep polling for a while before asking again
+            signal_unsubscribe(&out_trans);
+            xQueueReset(signal_queue);
+            backoff = SIGNAL_SUBSCRIBE_BACKOFF;
+            ESP_LOGW(SIGNAL_TAG, "polling, subscribing again in %d s", SIGNAL_SUBSCRIBE_BACKOFF);
+        }
 
-        // log output (process in real task)
-        ESP_LOGI(RPM_TAG, "Received data: ");
-        esp_log_buffer(RPM_TAG, dta, dta_len);
+        // fall back to one read for every signal, either through the rate
+        // dids or by listing each signal did: 22 (DD DD)...
+        out_trans.req[0] = UDS_SVC_RDBI;
+        out_trans.req_len = 1;
+        if (mode == SIGNAL_POLL_COMPOSITE)
+        {
+            for (uint8_t rate = UDS_RATE_SLOW; rate <= UDS_RATE_FAST; rate++)
+            {
+                if (signal_rate_used(rate))
+                {
+                    uds_put_did(&out_trans.req[out_trans.req_len], UDS_DID_PERIODIC(rate));
+                    out_trans.req_len += 2;
+                }
+            }
+        }
+        else
+        {
+            for (int i = 0; i < SIGNAL_COUNT; i++)
+            {
+                uds_put_did(&out_trans.req[out_trans.req_len], signals[i].did);
+                out_trans.req_len += 2;
+            }
+        }
+        obd_transact(&out_trans);
+
+        if (dta_len < 1 || dta[0] != UDS_POS_RESP(UDS_SVC_RDBI))
+        {
+            ESP_LOGE(SIGNAL_TAG, "read rejected");
+            esp_log_buffer(SIGNAL_TAG, dta, dta_len);
+            if (mode == SIGNAL_POLL_COMPOSITE)
+            {
+                // slave may have reset and lost the definitions
+                backoff = 0;
+            }
+            continue;
+        }
+
+        pos = 1;
+        if (mode == SIGNAL_POLL_COMPOSITE)
+        {
+            // 62 (DD DD (signal...))..., signals in the same order as defined
+            for (uint8_t rate = UDS_RATE_SLOW; rate <= UDS_RATE_FAST; rate++)
+            {
+                if (!signal_rate_used(rate))
+                {
+                    continue;
+                }
+                if (pos + 2 > dta_len || uds_get_did(&dta[pos]) != UDS_DID_PERIODIC(rate))
+                {
+                    ESP_LOGE(SIGNAL_TAG, "did %04x missing", UDS_DID_PERIODIC(rate));
+                    break;
+                }
+                pos += 2;
+                for (int i = 0; i < SIGNAL_COUNT; i++)
+                {
+                    if (signals[i].rate != rate)
+                    {
+                        continue;
+                    }
+                    if (pos + signals[i].size > dta_len)
+                    {
+                        ESP_LOGE(SIGNAL_TAG, "response too short");
+                        break;
+                    }
+                    signal_log(i, &dta[pos]);
+                    pos += signals[i].size;
+                }
+            }
+            continue;
+        }
+
+        // 62 (DD DD signal)...
+        for (int i = 0; i < SIGNAL_COUNT; i++)
+        {
+            if (pos + 2 + signals[i].size > dta_len || 
+                uds_get_did(&dta[pos]) != signals[i].did)
+            {
+                ESP_LOGE(SIGNAL_TAG, "did %04x missing", signals[i].did);
+                break;
+            }
+            signal_log(i, &dta[pos + 2]);
+            pos += 2 + signals[i].size;
+        }
+    }
+}
+
+// route every received frame: responses to the control task, periodic
+// messages to whoever subscribed to their periodic did
+static void twai_rx_task(void *arg)
+{
+    xSemaphoreTake(twai_rx_task_sem, portMAX_DELAY);
+    twai_message_t inc_msg;
+    QueueHandle_t queue;
+
+    ESP_LOGI(RX_TAG, "rx task started");
+
+    for (;;)
+    {
+        if (twai_receive(&inc_msg, portMAX_DELAY) != ESP_OK)
+        {
+            continue;
+        }
+
+        switch (inc_msg.identifier)
+        {
+        case ID_SLAVE_RESP_DTA:
+            // a stuck control task must not stop periodic routing
+            if (xQueueSend(twai_resp_queue, &inc_msg, RESP_QUEUE_TIMEOUT) != pdTRUE)
+            {
+                resp_dropped++;
+                ESP_LOGW(RX_TAG, "dropped response frame (%lu total)", (unsigned long)resp_dropped);
+            }
+            break;
+        case ID_SLAVE_PERIODIC_DTA:
+            if (inc_msg.data_length_code < 1)
+            {
+                break;
+            }
+            xSemaphoreTake(periodic_route_mut, portMAX_DELAY);
+            queue = periodic_routes[inc_msg.data[0]];
+            xSemaphoreGive(periodic_route_mut);
+
+            // never stall the bus for a slow consumer
+            if (queue && xQueueSend(queue, &inc_msg, 0) != pdTRUE)
+            {
+                ESP_LOGW(RX_TAG, "dropped periodic did %02x", inc_msg.data[0]);
+            }
+            break;
+        default:
+            break;
+        }
     }
 }
 
@@ -217,12 +512,13 @@ static void twai_ctrl_task(void *arg)
     twai_message_t out_msg;
     uint8_t frame_len;
     uint8_t clear_to_send; // remaining frames before another clear-to-send is necessary
-    uint8_t rem_dta;       // remaining data length, used for multiple frame transaction
-    uint8_t frame_type;    // storage for frame type
+    static isotp::reassembler_t<obd_tp_t> rx; // response being received
+    uint16_t req_pos;      // request bytes already transmitted
+    uint8_t cons_delay = 0; // delay between consecutive request frames
+    uint8_t counter = 1;   // mod 0x10 counter for consecutive request frames
     ctrl_task_action_t state;
     obd_transaction_t t;
 
-    ESP_ERROR_CHECK(twai_start());
     ESP_LOGI(CTRL_TAG, "twai task started");
 
     for (;;)
@@ -232,7 +528,7 @@ static void twai_ctrl_task(void *arg)
 
         // reset finite state machine to make a request
         state = TX_SEND_REQ;
-        rem_dta = 0;
+        rx.reset();
         clear_to_send = 0;
         *t.dta_len = 0;
 
@@ -242,87 +538,135 @@ static void twai_ctrl_task(void *arg)
             switch (state)
             {
             case TX_SEND_REQ:
-                // send a single frame
+                // frames left over from an abandoned transaction are not ours
+                xQueueReset(twai_resp_queue);
+                ESP_LOGI(
+                    CTRL_TAG,
+                    "transmit request %02x %02x (%d bytes)",
+                    t.req[0],
+                    t.req[1],
+                    t.req_len);
                 out_msg.identifier = ID_MASTER_REQ_DTA;
-                out_msg.data_length_code = 8;
-                out_msg.data[0] = 0x02;
-                out_msg.data[1] = t.service;
-                out_msg.data[2] = t.s_id;                
-                for (int i = 3; i < 8; i++)
+                if (t.req_len <= obd_tp_t::SF_DATA_MAX)
                 {
-                    out_msg.data[i] = 0xAA;
+                    // whole request fits in a single frame
+                    out_msg.data_length_code = obd_tp_t::single(out_msg.data, t.req, t.req_len);
+                    state = RX_RECV_SLAVE_SNGL_FRST;
+                }
+                else
+                {
+                    out_msg.data_length_code = obd_tp_t::first(out_msg.data, t.req, t.req_len);
+                    req_pos = obd_tp_t::FF_DATA_LEN;
+                    counter = 1;
+                    state = RX_RECV_SLAVE_FLOW;
                 }
-                ESP_LOGI(
-                    CTRL_TAG,
-                    "transmit request %02x %02x",
-                    out_msg.data[1],
-                    out_msg.data[2]);
                 twai_transmit(&out_msg, portMAX_DELAY);
-                esp_log_buffer(CTRL_TAG, out_msg.data, 8);
-                state = RX_RECV_SLAVE_SNGL_FRST;
+                esp_log_buffer(CTRL_TAG, out_msg.data, out_msg.data_length_code);
+                break;
+            case RX_RECV_SLAVE_FLOW:
+                ESP_LOGI(CTRL_TAG, "receive clear-to-send");
+                xQueueReceive(twai_resp_queue, &inc_msg, portMAX_DELAY);
+                esp_log_buffer(CTRL_TAG, inc_msg.data, inc_msg.data_length_code);
+                if (obd_tp_t::type(inc_msg.data) != isotp::frame_type_t::FLOW)
+                {
+                    ESP_LOGI(CTRL_TAG, "identified unexpected frame");
+                    state = IDLE;
+                    break;
+                }
+                switch (obd_tp_t::flow_status(inc_msg.data))
+                {
+                case isotp::flow_status_t::CLEAR_TO_SEND:
+                    clear_to_send = obd_tp_t::flow_block_size(inc_msg.data);
+                    cons_delay = obd_tp_t::flow_st_min(inc_msg.data);
+                    state = TX_SEND_CONS;
+                    break;
+                case isotp::flow_status_t::WAIT:
+                    state = RX_RECV_SLAVE_FLOW;
+                    break;
+                default:
+                    ESP_LOGI(CTRL_TAG, "request refused by slave");
+                    state = IDLE;
+                    break;
+                }
+                break;
+            case TX_SEND_CONS:
+                vTaskDelay(pdMS_TO_TICKS(cons_delay));
+                out_msg.identifier = ID_MASTER_REQ_DTA;
+                frame_len = obd_tp_t::consecutive_len(t.req_len - req_pos);
+                out_msg.data_length_code = obd_tp_t::consecutive(
+                    out_msg.data,
+                    counter,
+                    &t.req[req_pos],
+                    frame_len);
+                twai_transmit(&out_msg, portMAX_DELAY);
+                esp_log_buffer(CTRL_TAG, out_msg.data, out_msg.data_length_code);
+                req_pos += frame_len;
+                counter = (counter + 1) & 0x0F;
+
+                if (req_pos < t.req_len)
+                {
+                    if (clear_to_send == 1)
+                    {
+                        state = RX_RECV_SLAVE_FLOW;
+                    }
+                    else
+                    {
+                        state = TX_SEND_CONS;
+                    }
+
+                    if (clear_to_send)
+                        clear_to_send--;
+                }
+                else
+                {
+                    state = RX_RECV_SLAVE_SNGL_FRST;
+                }
                 break;
             case RX_RECV_SLAVE_SNGL_FRST:
                 // get first frame
                 ESP_LOGI(
                     CTRL_TAG, 
                     "receive single/first frame");
-                twai_receive(&inc_msg, portMAX_DELAY);
-                esp_log_buffer(CTRL_TAG, inc_msg.data, 8);
-                frame_type = MSB_NIBBLE(inc_msg.data[0]);
-                if (frame_type == OBD_FRAME_SINGLE)
+                xQueueReceive(twai_resp_queue, &inc_msg, portMAX_DELAY);
+                esp_log_buffer(CTRL_TAG, inc_msg.data, inc_msg.data_length_code);
+                switch (rx.feed(inc_msg.data, inc_msg.data_length_code))
                 {
+                case isotp::rx_status_t::COMPLETE:
                     ESP_LOGI(CTRL_TAG, "identified single frame");
-                    // all data is in this frame
-                    frame_len = LSB_NIBBLE(inc_msg.data[0]);
-                    memcpy(&t.dta[*t.dta_len], &inc_msg.data[1], frame_len);
-                    rem_dta = 0;
-                    *t.dta_len += frame_len;
-
                     state = IDLE;
-                }
-                else if (frame_type == OBD_FRAME_FIRST)
-                {
-                    // first 6 bytes of data is in this frame
-                    frame_len = 6;
-                    memcpy(&t.dta[*t.dta_len], &inc_msg.data[2], frame_len);
-                    rem_dta = LSB_NIBBLE(inc_msg.data[0]) | inc_msg.data[1];
+                    break;
+                case isotp::rx_status_t::IN_PROGRESS:
                     ESP_LOGI(
                         CTRL_TAG,
                         "identified first frame (%d bytes remain)",
-                        rem_dta);
-                    rem_dta -= frame_len;
-                    *t.dta_len += frame_len;
-
+                        rx.total - rx.len);
                     state = TX_SEND_FLOW;
-                }
-                else
-                {
-                    // ??? confusion ???
+                    break;
+                default:
+                    // ??? confusion ??? or a length that doesn't fit the frame
                     ESP_LOGI(
                         CTRL_TAG,
-                        "identified unknown frame %d",
-                        frame_type);
+                        "identified unexpected frame %d",
+                        (int)obd_tp_t::type(inc_msg.data));
                     state = IDLE;
+                    break;
                 }
                 break;
             case TX_SEND_FLOW:
                 out_msg.identifier = ID_MASTER_REQ_DTA;
-                out_msg.data_length_code = 8;
-                out_msg.data[0] = 0x30;
-                out_msg.data[1] = OBD_CONSEC_COUNT;
-                out_msg.data[2] = OBD_CONSEC_DELAY;
-                for (int i = 3; i < 8; i++)
-                {
-                    out_msg.data[i] = 0xAA;
-                }
+                out_msg.data_length_code = obd_tp_t::flow(
+                    out_msg.data,
+                    isotp::flow_status_t::CLEAR_TO_SEND,
+                    OBD_CONSEC_COUNT,
+                    OBD_CONSEC_DELAY);
                 clear_to_send = OBD_CONSEC_COUNT;
                 ESP_LOGI(
                     CTRL_TAG,
                     "transmit clear-to-send BS: %02x; STmin: %02x",
-                    out_msg.data[1],
-                    out_msg.data[2]);
+                    OBD_CONSEC_COUNT,
+                    OBD_CONSEC_DELAY);
                 twai_transmit(&out_msg, portMAX_DELAY);
-                esp_log_buffer(CTRL_TAG, out_msg.data, 8);
+                esp_log_buffer(CTRL_TAG, out_msg.data, out_msg.data_length_code);
 
                 state = RX_RECV_SLAVE_CONS;
                 break;
@@ -332,17 +676,21 @@ static void twai_ctrl_task(void *arg)
                     "receive consecutive (%02x / %02x; %d bytes remain)",
                     clear_to_send,
                     OBD_CONSEC_COUNT,
-                    rem_dta);
+                    rx.total - rx.len);
 
-                twai_receive(&inc_msg, portMAX_DELAY);
-                esp_log_buffer(CTRL_TAG, inc_msg.data, 8);
-                frame_len = MIN(7, rem_dta);
-                memcpy(&t.dta[*t.dta_len], &inc_msg.data[1], frame_len);
-                *t.dta_len += frame_len;
-                rem_dta -= frame_len;
+                xQueueReceive(twai_resp_queue, &inc_msg, portMAX_DELAY);
+                esp_log_buffer(CTRL_TAG, inc_msg.data, inc_msg.data_length_code);
+                if (obd_tp_t::type(inc_msg.data) != isotp::frame_type_t::CONSECUTIVE)
+                {
+                    ESP_LOGI(CTRL_TAG, "identified unexpected frame");
+                    rx.reset();
+                    state = IDLE;
+                    break;
+                }
 
-                if (rem_dta)
+                switch (rx.feed(inc_msg.data, inc_msg.data_length_code))
                 {
+                case isotp::rx_status_t::IN_PROGRESS:
                     if (clear_to_send == 1)
                     {
                         state = TX_SEND_FLOW;
@@ -354,10 +702,14 @@ static void twai_ctrl_task(void *arg)
 
                     if (clear_to_send)
                         clear_to_send--;
-                }
-                else
-                {
+                    break;
+                case isotp::rx_status_t::COMPLETE:
+                    state = IDLE;
+                    break;
+                default:
+                    ESP_LOGI(CTRL_TAG, "identified sequence error");
                     state = IDLE;
+                    break;
                 }
                 break;
             case IDLE:
@@ -367,6 +719,13 @@ static void twai_ctrl_task(void *arg)
             }
         }
 
+        // hand over a complete response, truncated to the caller's buffer
+        if (rx.len && rx.len == rx.total)
+        {
+            *t.dta_len = MIN(rx.len, t.max_len);
+            memcpy(t.dta, rx.dta, *t.dta_len);
+        }
+
         // notify task that data is written to buffer supplied in request
         xSemaphoreGive(*t.sem);
     }
@@ -389,17 +748,33 @@ extern "C" void app_main(void)
     ESP_ERROR_CHECK(twai_driver_install(&g_config, &t_config, &f_config));
     ESP_LOGI(MAIN_TAG, "TWAI driver started");
 
+    // both the rx and control task use the bus
+    ESP_ERROR_CHECK(twai_start());
+    stream_start(OBD_BITRATE, false);
+
     // inter-process communication
     twai_task_sem = xSemaphoreCreateBinary();
     vin_task_sem = xSemaphoreCreateBinary();
-    speed_task_sem = xSemaphoreCreateBinary();
-    rpm_task_sem = xSemaphoreCreateBinary();
+    signal_task_sem = xSemaphoreCreateBinary();
+    twai_rx_task_sem = xSemaphoreCreateBinary();
+    periodic_route_mut = xSemaphoreCreateMutex();
 
     obd_trans_queue = xQueueCreate(5, sizeof(obd_transaction_t));
+    twai_resp_queue = xQueueCreate(16, sizeof(twai_message_t));
+    signal_queue = xQueueCreate(16, sizeof(twai_message_t));
 
     ESP_LOGI(MAIN_TAG, "starting tasks");
 
     // create tasks
+    xTaskCreatePinnedToCore(
+        twai_rx_task,
+        "twai_rx_task",
+        16384,
+        NULL,
+        RX_TASK_PRIO,
+        NULL,
+        tskNO_AFFINITY);
+
     xTaskCreatePinnedToCore(
         twai_ctrl_task,
         "twai_task",
@@ -420,18 +795,8 @@ extern "C" void app_main(void)
     );
 
     xTaskCreatePinnedToCore(
-        speed_task,
-        "speed_task",
-        16384,
-        NULL,
-        OBD_TASK_PRIO,
-        NULL,
-        tskNO_AFFINITY
-    );
-
-    xTaskCreatePinnedToCore(
-        rpm_task,
-        "rpm_task",
+        signal_task,
+        "signal_task",
         16384,
         NULL,
         OBD_TASK_PRIO,
@@ -441,9 +806,9 @@ extern "C" void app_main(void)
 
     // start control task
     xSemaphoreGive(twai_task_sem);
+    xSemaphoreGive(twai_rx_task_sem);
     xSemaphoreGive(vin_task_sem);
-    xSemaphoreGive(speed_task_sem);
-    xSemaphoreGive(rpm_task_sem);
+    xSemaphoreGive(signal_task_sem);
 
     // tasks running, return
     return;
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "stream.h"
+
+/* -------------------------------------------------------------------------- */
+/*                      Definitions and static variables                      */
+/* -------------------------------------------------------------------------- */
+// Linux host build only: replays a candump log from stdin onto the GVRET
+// stream, so the host tooling can be exercised without a board.
+//
+//   (1700000000.123456) can0 7E8#10144902014B4D48
+
+#define REPLAY_TASK_PRIO 5
+#define REPLAY_TAG "replay_task"
+#define MAIN_TAG "bus replay"
+#define REPLAY_BITRATE 500000
+#define REPLAY_LINE_MAX 128
+#define REPLAY_IDLE_DELAY (pdMS_TO_TICKS(10))
+
+/* -------------------------------------------------------------------------- */
+/*                             Tasks and functions                            */
+/* -------------------------------------------------------------------------- */
+
+// read one line from stdin, false at end of input. The FreeRTOS POSIX port
+// runs one task at a time, so stdin is non-blocking and waits are task delays
+static bool replay_line(char *line, int max)
+{
+    static char buf[REPLAY_LINE_MAX];
+    static int len = 0;
+    char *nl;
+    ssize_t n;
+
+    for (;;)
+    {
+        nl = (char *)memchr(buf, '\n', len);
+        if (nl)
+        {
+            *nl = '\0';
+            strncpy(line, buf, max - 1);
+            line[max - 1] = '\0';
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len);
+            return true;
+        }
+        if (len == sizeof(buf))
+        {
+            // overlong line, drop it
+            len = 0;
+        }
+
+        n = read(STDIN_FILENO, &buf[len], sizeof(buf) - len);
+        if (n == 0)
+        {
+            return false;
+        }
+        if (n < 0)
+        {
+            vTaskDelay(REPLAY_IDLE_DELAY);
+            continue;
+        }
+        len += n;
+    }
+}
+
+// parse a candump log line, false if it isn't a data frame
+static bool replay_parse(
+    const char *line,
+    uint64_t *ts,
+    uint32_t *identifier,
+    bool *extd,
+    uint8_t *dta,
+    uint8_t *dlc)
+{
+    unsigned long sec;
+    unsigned long usec;
+    char id[16];
+    char hex[32];
+    unsigned int byte;
+
+    if (sscanf(line, "(%lu.%lu) %*s %15[0-9A-Fa-f]#%31s", &sec, &usec, id, hex) < 3)
+    {
+        return false;
+    }
+    if (hex[0] == 'R')
+    {
+        // remote frames carry no data worth replaying
+        return false;
+    }
+
+    *ts = (uint64_t)sec * 1000000 + usec;
+    *identifier = strtoul(id, NULL, 16);
+    *extd = strlen(id) > 3;
+    *dlc = 0;
+    while (*dlc < 8 && sscanf(&hex[*dlc * 2], "%2x", &byte) == 1)
+    {
+        dta[(*dlc)++] = (uint8_t)byte;
+    }
+    return true;
+}
+
+// wait for the host, then replay the log with its original frame spacing
+static void replay_task(void *arg)
+{
+    char line[REPLAY_LINE_MAX];
+    uint64_t first = 0;
+    uint64_t ts;
+    uint32_t identifier;
+    uint32_t frames = 0;
+    uint8_t dta[8];
+    uint8_t dlc;
+    bool extd;
+    TickType_t start;
+    TickType_t due;
+    TickType_t elapsed;
+
+    while (!stream_connected())
+    {
+        vTaskDelay(REPLAY_IDLE_DELAY);
+    }
+    ESP_LOGI(REPLAY_TAG, "host connected, replaying");
+    start = xTaskGetTickCount();
+
+    while (replay_line(line, sizeof(line)))
+    {
+        if (!replay_parse(line, &ts, &identifier, &extd, dta, &dlc))
+        {
+            continue;
+        }
+        if (!frames++)
+        {
+            first = ts;
+        }
+        ts -= first;
+
+        // keep the log's frame spacing
+        due = pdMS_TO_TICKS(ts / 1000);
+        elapsed = xTaskGetTickCount() - start;
+        if (due > elapsed)
+        {
+            vTaskDelay(due - elapsed);
+        }
+        stream_frame((uint32_t)ts, identifier, extd, STREAM_BUS_CAN, dta, dlc);
+    }
+
+    ESP_LOGI(
+        REPLAY_TAG,
+        "replayed %lu frames; stream dropped: %lu",
+        (unsigned long)frames,
+        (unsigned long)stream_dropped());
+    vTaskDelete(NULL);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                              Application main                              */
+/* -------------------------------------------------------------------------- */
+
+extern "C" void app_main(void)
+{
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    stream_start(REPLAY_BITRATE, true);
+
+    ESP_LOGI(MAIN_TAG, "starting tasks");
+
+    xTaskCreatePinnedToCore(
+        replay_task,
+        "replay_task",
+        8192,
+        NULL,
+        REPLAY_TASK_PRIO,
+        NULL,
+        tskNO_AFFINITY);
+
+    // tasks running, return
+    return;
+}
@@ -4,11 +4,15 @@
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "freertos/timers.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "driver/twai.h"
 #include <string.h>
 #include "esp_random.h"
+#include "isotp.h"
+#include "obd.h"
+#include "uds.h"
 
 /* -------------------------------------------------------------------------- */
 /*                      Definitions and static variables                      */
@@ -24,7 +28,6 @@
 #define RX_TASK_PRIO 8
 #define TX_TASK_PRIO 9
 #define CTRL_TASK_PRIO 10
-#define OBD_TASK_PRIO 7
 #define TX_GPIO_NUM GPIO_NUM_5
 #define RX_GPIO_NUM GPIO_NUM_16
 #define CTRL_TAG "ctrl_task"
@@ -32,19 +35,28 @@
 #define RX_TAG "rx_task"
 #define TX_TAG "tx_task"
 
-#define ID_MASTER_REQ_DTA 0x7DF
-#define OBD_SVC_DTA 0x01
-#define OBD_DEV_RPM 0x0C
-#define OBD_DEV_SPD 0x0D
-#define OBD_SVC_INF 0x09
-#define OBD_INF_VIN 0x02
-#define ID_SLAVE_RESP_DTA 0x7E8
+// oldest value served per signal, a read after that samples again. Periodic
+// rates are limited to ones slower than this, so every push carries a new
+// value: rpm fits the fast rate, speed the medium one
+#define RPM_MAX_AGE (pdMS_TO_TICKS(40))
+#define SPEED_MAX_AGE (pdMS_TO_TICKS(150))
+#define SIGNAL_MAX_LEN 4
 
-#define INFO_UPDATE_PERIOD (pdMS_TO_TICKS(300));
+#define UDS_DYN_DID_COUNT 4 // dynamically defined dids held at once
+#define UDS_DYN_DID_ELEMS 8 // sources per dynamically defined did
+#define UDS_DID_MAX_LEN 32  // longest did record
+#define UDS_PERIODIC_COUNT 8 // periodic dids scheduled at once
+
+// periodic transmitter tick is the fast rate, other rates are multiples
+#define PERIODIC_TICK (pdMS_TO_TICKS(50))
 
 typedef enum
 {
     RX_RECV_REQ,
+    TX_SEND_FLOW,
+    TX_SEND_OVFL,
+    RX_RECV_CONS,
+    PROC_REQ,
     TX_SEND_SNGL,
     TX_SEND_FRST,
     RX_RECV_FLOW,
@@ -52,24 +64,83 @@ typedef enum
     IDLE,
 } ctrl_task_action_t;
 
+
+typedef struct
+{
+    uint16_t src; // source did
+    uint8_t pos;  // first byte in source record, 1-based
+    uint8_t size; // bytes taken from source record
+} uds_dyn_elem_t;
+
+typedef struct
+{
+    uint16_t did; // 0 when slot is free
+    uint8_t count;
+    uds_dyn_elem_t elem[UDS_DYN_DID_ELEMS];
+} uds_dyn_did_t;
+
+typedef struct
+{
+    // model, computes a fresh value into out and returns its length
+    uint8_t (*produce)(uint8_t *out);
+    TickType_t max_age;
+
+    // last sample, guarded by mut
+    SemaphoreHandle_t mut;
+    bool valid;
+    TickType_t sampled;
+    uint8_t len;
+    uint8_t value[SIGNAL_MAX_LEN];
+} obd_signal_t;
+
+typedef struct
+{
+    uint16_t did;
+    uint8_t len;
+    uint8_t (*read)(uint8_t *out); // copies value to out, returns len
+    obd_signal_t *signal;          // sampled source, NULL for constants
+} uds_did_t;
+
+typedef struct
+{
+    uint8_t pdid; // low byte of 0xF2xx
+    uint8_t rate; // 0x2A transmission mode, 0 when slot is free
+} uds_periodic_t;
+
 static const twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(
     TX_GPIO_NUM,
     RX_GPIO_NUM,
     TWAI_MODE_NORMAL);
 
-static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_500KBITS();
+static const twai_timing_config_t t_config = OBD_TIMING_CONFIG();
 static const twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
 
 static SemaphoreHandle_t twai_task_sem;
-static SemaphoreHandle_t obd_info_mut;
-
-static uint16_t rpm;
-static uint8_t speed;
-
-#define MSB_BYTE(A) ((A >> 8) & 0xFF)
-#define LSB_BYTE(A) ((A) & 0xFF)
-#define MSB_NIBBLE(A) ((A >> 4) & 0x0F)
-#define LSB_NIBBLE(A) ((A) & 0x0F)
+static SemaphoreHandle_t uds_did_mut;
+static SemaphoreHandle_t periodic_tick_sem;
+static TimerHandle_t periodic_timer;
+
+static uint8_t produce_rpm(uint8_t *out);
+static uint8_t produce_speed(uint8_t *out);
+
+// signals are only sampled when read and their cached value is too old,
+// nothing runs for signals nobody asks for
+static obd_signal_t obd_signals[] = {
+    {produce_rpm, RPM_MAX_AGE, NULL, false, 0, 0, {0}},
+    {produce_speed, SPEED_MAX_AGE, NULL, false, 0, 0, {0}},
+};
+#define SIGNAL_RPM (&obd_signals[0])
+#define SIGNAL_SPD (&obd_signals[1])
+#define SIGNAL_COUNT ((int)(sizeof(obd_signals) / sizeof(obd_signals[0])))
+
+// guarded by uds_did_mut, shared by control and periodic transmit task. The
+// lock only covers these tables, signals are sampled after releasing it so a
+// slow model never holds up the other task
+static uds_dyn_did_t dyn_dids[UDS_DYN_DID_COUNT];
+static uds_periodic_t periodic[UDS_PERIODIC_COUNT];
+
+// ticks between periodic messages by transmission mode: 1 s, 200 ms, 50 ms
+static const uint8_t periodic_ticks[] = {0, 20, 4, 1};
 
 // KMHC75LD0MU250580
 static const uint8_t vin[] = {
@@ -82,6 +153,510 @@ static const uint8_t vin[] = {
 /*                             Tasks and Functions                            */
 /* -------------------------------------------------------------------------- */
 
+static uint16_t uds_negative(uint8_t *resp, uint8_t service, uint8_t nrc)
+{
+    resp[0] = UDS_NEG_RESP;
+    resp[1] = service;
+    resp[2] = nrc;
+    return 3;
+}
+
+static uint8_t produce_rpm(uint8_t *out)
+{
+    uint16_t rpm = (uint16_t) (esp_random() & 0xFFFF);
+    out[0] = (uint8_t) (rpm >> 8);
+    out[1] = (uint8_t) rpm;
+    return 2;
+}
+
+static uint8_t produce_speed(uint8_t *out)
+{
+    out[0] = (uint8_t) (esp_random() & 0xFF);
+    return 1;
+}
+
+// copy the signal to out, sampling it first if the cached value is stale
+static uint8_t signal_read(obd_signal_t *s, uint8_t *out)
+{
+    TickType_t now;
+    uint8_t len;
+
+    xSemaphoreTake(s->mut, portMAX_DELAY);
+    now = xTaskGetTickCount();
+    if (!s->valid || (TickType_t)(now - s->sampled) >= s->max_age)
+    {
+        s->len = s->produce(s->value);
+        s->sampled = now;
+        s->valid = true;
+    }
+    len = s->len;
+    memcpy(out, s->value, len);
+    xSemaphoreGive(s->mut);
+    return len;
+}
+
+static uint8_t did_read_rpm(uint8_t *out)
+{
+    return signal_read(SIGNAL_RPM, out);
+}
+
+static uint8_t did_read_speed(uint8_t *out)
+{
+    return signal_read(SIGNAL_SPD, out);
+}
+
+static uint8_t did_read_vin(uint8_t *out)
+{
+    // skip the item count used by service 0x09
+    memcpy(out, &vin[1], sizeof(vin) - 1);
+    return sizeof(vin) - 1;
+}
+
+static const uds_did_t did_table[] = {
+    {UDS_DID_RPM, 2, did_read_rpm, SIGNAL_RPM},
+    {UDS_DID_SPD, 1, did_read_speed, SIGNAL_SPD},
+    {UDS_DID_VIN, 17, did_read_vin, NULL},
+};
+
+static const uds_did_t *did_find(uint16_t did)
+{
+    for (size_t i = 0; i < sizeof(did_table) / sizeof(did_table[0]); i++)
+    {
+        if (did_table[i].did == did)
+        {
+            return &did_table[i];
+        }
+    }
+    return NULL;
+}
+
+static uds_dyn_did_t *dyn_did_find(uint16_t did)
+{
+    for (int i = 0; i < UDS_DYN_DID_COUNT; i++)
+    {
+        if (dyn_dids[i].did == did)
+        {
+            return &dyn_dids[i];
+        }
+    }
+    return NULL;
+}
+
+// copy a dynamic did's definition out under the lock, false if undefined
+static bool dyn_did_get(uint16_t did, uds_dyn_did_t *out)
+{
+    uds_dyn_did_t *d;
+
+    if (!UDS_IS_DYN_DID(did))
+    {
+        return false;
+    }
+
+    xSemaphoreTake(uds_did_mut, portMAX_DELAY);
+    d = dyn_did_find(did);
+    if (d)
+    {
+        *out = *d;
+    }
+    xSemaphoreGive(uds_did_mut);
+    return d != NULL;
+}
+
+// length of a static or dynamic did without sampling it, -1 if unknown
+static int did_len(uint16_t did)
+{
+    const uds_did_t *s;
+    uds_dyn_did_t d;
+    int len = 0;
+
+    s = did_find(did);
+    if (s)
+    {
+        return s->len;
+    }
+    if (!dyn_did_get(did, &d))
+    {
+        return -1;
+    }
+    for (int i = 0; i < d.count; i++)
+    {
+        len += d.elem[i].size;
+    }
+    return len;
+}
+
+// longest max_age among the signals a did samples, 0 if it samples none.
+// Caller holds uds_did_mut
+static TickType_t did_max_age(uint16_t did)
+{
+    const uds_did_t *s;
+    uds_dyn_did_t *d;
+    TickType_t age = 0;
+
+    s = did_find(did);
+    if (s)
+    {
+        return s->signal ? s->signal->max_age : 0;
+    }
+
+    d = UDS_IS_DYN_DID(did) ? dyn_did_find(did) : NULL;
+    for (int i = 0; d && i < d->count; i++)
+    {
+        s = did_find(d->elem[i].src);
+        if (s->signal && s->signal->max_age > age)
+        {
+            age = s->signal->max_age;
+        }
+    }
+    return age;
+}
+
+// read a static or dynamic did into out, returns length or -1 if unknown.
+// Takes uds_did_mut itself, callers must not hold it
+static int did_read(uint16_t did, uint8_t *out)
+{
+    uint8_t src[UDS_DID_MAX_LEN];
+    const uds_did_t *s;
+    uds_dyn_did_t d;
+    int len = 0;
+
+    s = did_find(did);
+    if (s)
+    {
+        return s->read(out);
+    }
+
+    if (!dyn_did_get(did, &d))
+    {
+        return -1;
+    }
+
+    // concatenate the selected bytes of every source in definition order
+    for (int i = 0; i < d.count; i++)
+    {
+        s = did_find(d.elem[i].src);
+        s->read(src);
+        memcpy(&out[len], &src[d.elem[i].pos - 1], d.elem[i].size);
+        len += d.elem[i].size;
+    }
+    return len;
+}
+
+static uint16_t uds_read_data_by_id(const uint8_t *req, uint16_t req_len, uint8_t *resp)
+{
+    uint8_t dta[UDS_DID_MAX_LEN];
+    uint16_t resp_len = 1;
+    uint16_t did;
+    int len;
+
+    if (req_len < 3 || ((req_len - 1) & 0x01))
+    {
+        return uds_negative(resp, UDS_SVC_RDBI, UDS_NRC_INCORRECT_LENGTH);
+    }
+
+    resp[0] = UDS_POS_RESP(UDS_SVC_RDBI);
+    for (uint16_t i = 1; i < req_len; i += 2)
+    {
+        did = uds_get_did(&req[i]);
+        len = did_read(did, dta);
+        if (len < 0)
+        {
+            // unsupported dids are left out of the response
+            ESP_LOGE(CTRL_TAG, "identified unsupported did %04x!", did);
+            continue;
+        }
+        if (resp_len + 2 + len > obd_tp_t::MAX_LEN)
+        {
+            return uds_negative(resp, UDS_SVC_RDBI, UDS_NRC_RESPONSE_TOO_LONG);
+        }
+        uds_put_did(&resp[resp_len], did);
+        memcpy(&resp[resp_len + 2], dta, len);
+        resp_len += 2 + len;
+    }
+
+    if (resp_len == 1)
+    {
+        return uds_negative(resp, UDS_SVC_RDBI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+    }
+    return resp_len;
+}
+
+static uint16_t uds_define_data_id(const uint8_t *req, uint16_t req_len, uint8_t *resp)
+{
+    uds_dyn_did_t *d;
+    const uds_did_t *s;
+    uint16_t did;
+    uint16_t len;
+    uint8_t count;
+
+    if (req_len < 2)
+    {
+        return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_INCORRECT_LENGTH);
+    }
+
+    switch (req[1])
+    {
+    case UDS_DDDI_DEFINE_BY_ID:
+        // 2C 01 DD DD (SS SS PP LL)...
+        if (req_len < 8 || ((req_len - 4) & 0x03))
+        {
+            return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_INCORRECT_LENGTH);
+        }
+        did = uds_get_did(&req[2]);
+        if (!UDS_IS_DYN_DID(did))
+        {
+            return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+        }
+
+        // repeated definitions of the same did append to it
+        d = dyn_did_find(did);
+        if (!d)
+        {
+            d = dyn_did_find(0);
+            if (!d)
+            {
+                return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+            }
+            d->count = 0;
+        }
+
+        // validate everything before touching the definition
+        count = d->count;
+        len = 0;
+        for (int i = 0; i < count; i++)
+        {
+            len += d->elem[i].size;
+        }
+        for (uint16_t i = 4; i < req_len; i += 4)
+        {
+            s = did_find(uds_get_did(&req[i]));
+            if (!s || req[i + 2] == 0 || req[i + 3] == 0 ||
+                req[i + 2] - 1 + req[i + 3] > s->len ||
+                count == UDS_DYN_DID_ELEMS)
+            {
+                return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+            }
+            len += req[i + 3];
+            count++;
+        }
+        if (len > UDS_DID_MAX_LEN)
+        {
+            return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+        }
+
+        for (uint16_t i = 4; i < req_len; i += 4)
+        {
+            d->elem[d->count].src = uds_get_did(&req[i]);
+            d->elem[d->count].pos = req[i + 2];
+            d->elem[d->count].size = req[i + 3];
+            d->count++;
+        }
+        d->did = did;
+        ESP_LOGI(CTRL_TAG, "defined did %04x (%d sources)", did, d->count);
+        break;
+    case UDS_DDDI_CLEAR:
+        // 2C 03 [DD DD], no did clears every definition
+        if (req_len == 2)
+        {
+            memset(dyn_dids, 0, sizeof(dyn_dids));
+            break;
+        }
+        if (req_len != 4)
+        {
+            return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_INCORRECT_LENGTH);
+        }
+        did = uds_get_did(&req[2]);
+        d = UDS_IS_DYN_DID(did) ? dyn_did_find(did) : NULL;
+        if (!d)
+        {
+            return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+        }
+        memset(d, 0, sizeof(*d));
+        break;
+    default:
+        return uds_negative(resp, UDS_SVC_DDDI, UDS_NRC_SUBFUNCTION_NOT_SUPPORTED);
+    }
+
+    memcpy(resp, req, req_len < 4 ? req_len : 4);
+    resp[0] = UDS_POS_RESP(UDS_SVC_DDDI);
+    return req_len < 4 ? req_len : 4;
+}
+
+static uint16_t uds_read_periodic(const uint8_t *req, uint16_t req_len, uint8_t *resp)
+{
+    uds_periodic_t *p;
+    TickType_t age;
+    uint8_t mode;
+    uint8_t rate;
+    int len;
+
+    if (req_len < 2)
+    {
+        return uds_negative(resp, UDS_SVC_RDBPI, UDS_NRC_INCORRECT_LENGTH);
+    }
+
+    mode = req[1];
+    if (mode < UDS_RATE_SLOW || mode > UDS_RATE_STOP)
+    {
+        return uds_negative(resp, UDS_SVC_RDBPI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+    }
+
+    if (mode == UDS_RATE_STOP)
+    {
+        // 2A 04 [PP...], no periodic did stops everything
+        xSemaphoreTake(uds_did_mut, portMAX_DELAY);
+        for (int i = 0; i < UDS_PERIODIC_COUNT; i++)
+        {
+            for (uint16_t j = 2; j < req_len; j++)
+            {
+                if (periodic[i].pdid == req[j])
+                {
+                    periodic[i].rate = 0;
+                }
+            }
+            if (req_len == 2)
+            {
+                periodic[i].rate = 0;
+            }
+        }
+        xSemaphoreGive(uds_did_mut);
+        resp[0] = UDS_POS_RESP(UDS_SVC_RDBPI);
+        return 1;
+    }
+
+    // 2A MM PP...
+    if (req_len < 3)
+    {
+        return uds_negative(resp, UDS_SVC_RDBPI, UDS_NRC_INCORRECT_LENGTH);
+    }
+    for (uint16_t i = 2; i < req_len; i++)
+    {
+        len = did_len(UDS_DID_PERIODIC(req[i]));
+        if (len < 0 || len > UDS_PERIODIC_DATA_MAX)
+        {
+            return uds_negative(resp, UDS_SVC_RDBPI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+        }
+    }
+
+    xSemaphoreTake(uds_did_mut, portMAX_DELAY);
+    for (uint16_t i = 2; i < req_len; i++)
+    {
+        // change the rate of an existing subscription or take a free slot
+        p = NULL;
+        for (int j = 0; j < UDS_PERIODIC_COUNT; j++)
+        {
+            if (periodic[j].rate && periodic[j].pdid == req[i])
+            {
+                p = &periodic[j];
+                break;
+            }
+            if (!periodic[j].rate && !p)
+            {
+                p = &periodic[j];
+            }
+        }
+        if (!p)
+        {
+            xSemaphoreGive(uds_did_mut);
+            return uds_negative(resp, UDS_SVC_RDBPI, UDS_NRC_REQUEST_OUT_OF_RANGE);
+        }
+
+        // a period within a source's max_age would resend its cached value,
+        // slow down until every message gets a new sample
+        rate = mode;
+        age = did_max_age(UDS_DID_PERIODIC(req[i]));
+        while (rate > UDS_RATE_SLOW && periodic_ticks[rate] * PERIODIC_TICK <= age)
+        {
+            rate--;
+        }
+        if (rate != mode)
+        {
+            ESP_LOGW(TX_TAG, "periodic did %02x limited to rate %d by max age", req[i], rate);
+        }
+
+        p->pdid = req[i];
+        p->rate = rate;
+        ESP_LOGI(TX_TAG, "scheduled periodic did %02x at rate %d", req[i], rate);
+    }
+    xSemaphoreGive(uds_did_mut);
+
+    resp[0] = UDS_POS_RESP(UDS_SVC_RDBPI);
+    return 1;
+}
+
+// build the response to a complete request in resp, returns response length
+static uint16_t obd_handle_request(const uint8_t *req, uint16_t req_len, uint8_t *resp)
+{
+    uint16_t resp_len = 0;
+
+    ESP_LOGI(
+        CTRL_TAG, 
+        "identified request %02x %02x (%d bytes)", 
+        req[0], 
+        req[1],
+        req_len
+    );
+
+    // response based on service and device
+    switch (req[0])
+    {
+    case OBD_SVC_DTA:
+        resp[0] = (0x01 << 6) | req[0];
+        resp[1] = req[1];
+        switch (req[1])
+        {
+        case OBD_DEV_RPM:
+            // 0x01 0x0C
+            resp_len = 2 + did_read_rpm(&resp[2]);
+            break;
+        case OBD_DEV_SPD:
+            // 0x01 0x0D
+            resp_len = 2 + did_read_speed(&resp[2]);
+            break;
+        default:
+            // unsupported device
+            ESP_LOGE(CTRL_TAG, "identfied unsupported device!");
+            break;
+        }
+        break;
+    case OBD_SVC_INF:
+        resp[0] = (0x01 << 6) | req[0];
+        resp[1] = req[1];
+        switch (req[1])
+        {
+        case OBD_INF_VIN:
+            // 0x09 0x02
+            memcpy(&resp[2], vin, 18);
+            resp_len = 20;
+            break;
+        default:
+            // unsupported info
+            ESP_LOGE(CTRL_TAG, "identified unsupported info!");
+            break;
+        }
+        break;
+    case UDS_SVC_RDBI:
+        resp_len = uds_read_data_by_id(req, req_len, resp);
+        break;
+    case UDS_SVC_DDDI:
+        // only edits definitions, never samples a signal
+        xSemaphoreTake(uds_did_mut, portMAX_DELAY);
+        resp_len = uds_define_data_id(req, req_len, resp);
+        xSemaphoreGive(uds_did_mut);
+        break;
+    case UDS_SVC_RDBPI:
+        resp_len = uds_read_periodic(req, req_len, resp);
+        break;
+    default:
+        // unsupported service
+        ESP_LOGE(CTRL_TAG, "identified unsupported service!");
+        resp_len = uds_negative(resp, req[0], UDS_NRC_SERVICE_NOT_SUPPORTED);
+        break;
+    }
+
+    return resp_len;
+}
+
 static void twai_control_task(void *arg)
 {
     xSemaphoreTake(twai_task_sem, portMAX_DELAY);
@@ -92,8 +667,9 @@ static void twai_control_task(void *arg)
     uint8_t clear_to_send = 0; // remaining #of frames clear-to-send
     uint8_t frame_len = 0; // number of data bytes in this frame
     uint8_t cons_delay = 0; // delay between consecutive frames
-    uint8_t counter = 1; // mod 0x0F counter for consective frames
-    uint8_t dta[4096]; // maximum length of data by CAN-TP spec
+    uint8_t counter = 1; // mod 0x10 counter for consective frames
+    static isotp::reassembler_t<obd_tp_t> req; // request being received
+    uint8_t dta[obd_tp_t::MAX_LEN]; // maximum length of data by CAN-TP spec
     ctrl_task_action_t state;
 
     ESP_ERROR_CHECK(twai_start());
@@ -106,6 +682,7 @@ static void twai_control_task(void *arg)
         state = RX_RECV_REQ;
         rem_dta = 0;
         dta_len = 0;
+        req.reset();
 
         while (state != IDLE)
         {
@@ -114,64 +691,67 @@ static void twai_control_task(void *arg)
             case RX_RECV_REQ:
                 // listen for the next time the obd diagnostic tool asks for something
                 twai_receive(&inc_msg, portMAX_DELAY);
-                ESP_LOGI(
-                    CTRL_TAG, 
-                    "identified request %02x %02x", 
-                    inc_msg.data[1], 
-                    inc_msg.data[2]
-                );
-
-                dta[0] = (0x01 << 6) | inc_msg.data[1];
-                dta[1] = inc_msg.data[2];
-
-                // response based on service and device
-                switch (inc_msg.data[1])
+                if (obd_tp_t::type(inc_msg.data) == isotp::frame_type_t::FIRST &&
+                    obd_tp_t::first_len(inc_msg.data) > UDS_MAX_REQ_LEN)
                 {
-                case OBD_SVC_DTA:
-                    switch (inc_msg.data[2])
-                    {
-                    case OBD_DEV_RPM:
-                        // 0x01 0x0C
-                        xSemaphoreTake(obd_info_mut, portMAX_DELAY);
-                        dta[2] = (uint8_t) (rpm >> 8);
-                        dta[3] = (uint8_t) rpm;
-                        xSemaphoreGive(obd_info_mut);
-                        rem_dta = 4;
-                        break;
-                    case OBD_DEV_SPD:
-                        // 0x01 0x0D
-                        xSemaphoreTake(obd_info_mut, portMAX_DELAY);
-                        dta[2] = speed;
-                        xSemaphoreGive(obd_info_mut);
-                        rem_dta = 3;
-                        break;
-                    default:
-                        // unsupported device
-                        ESP_LOGE(CTRL_TAG, "identfied unsupported device!");
-                        break;
-                    }
+                    ESP_LOGE(CTRL_TAG, "identified oversized request!");
+                    state = TX_SEND_OVFL;
                     break;
-                case OBD_SVC_INF:
-                    switch (inc_msg.data[2])
-                    {
-                    case OBD_INF_VIN:
-                        // 0x09 0x02
-                        memcpy(&dta[2], vin, 18);
-                        rem_dta = 20;
-                        break;
-                    default:
-                        // unsupported info
-                        ESP_LOGE(CTRL_TAG, "identified unsupported info!");
-                        break;
-                    }
+                }
+                switch (req.feed(inc_msg.data, inc_msg.data_length_code))
+                {
+                case isotp::rx_status_t::COMPLETE:
+                    state = PROC_REQ;
+                    break;
+                case isotp::rx_status_t::IN_PROGRESS:
+                    state = TX_SEND_FLOW;
+                    break;
+                default:
+                    // malformed frame, stray flow control or consecutive frame
+                    ESP_LOGE(CTRL_TAG, "identified unexpected frame!");
+                    break;
+                }
+                break;
+            case TX_SEND_FLOW:
+            case TX_SEND_OVFL:
+                // ask for the whole request at once, or refuse if it won't fit
+                out_msg.identifier = ID_SLAVE_RESP_DTA;
+                out_msg.data_length_code = obd_tp_t::flow(
+                    out_msg.data,
+                    (state == TX_SEND_FLOW) ?
+                        isotp::flow_status_t::CLEAR_TO_SEND :
+                        isotp::flow_status_t::OVERFLOW,
+                    0,
+                    0);
+                twai_transmit(&out_msg, portMAX_DELAY);
+                state = (state == TX_SEND_FLOW) ? RX_RECV_CONS : IDLE;
+                break;
+            case RX_RECV_CONS:
+                twai_receive(&inc_msg, portMAX_DELAY);
+                if (obd_tp_t::type(inc_msg.data) != isotp::frame_type_t::CONSECUTIVE)
+                {
+                    ESP_LOGE(CTRL_TAG, "identified unexpected frame!");
+                    state = IDLE;
+                    break;
+                }
+                switch (req.feed(inc_msg.data, inc_msg.data_length_code))
+                {
+                case isotp::rx_status_t::COMPLETE:
+                    state = PROC_REQ;
+                    break;
+                case isotp::rx_status_t::IN_PROGRESS:
+                    state = RX_RECV_CONS;
                     break;
                 default:
-                    // unsupported service
-                    ESP_LOGE(CTRL_TAG, "identified unsupported service!");
+                    ESP_LOGE(CTRL_TAG, "identified sequence error!");
+                    state = IDLE;
                     break;
                 }
+                break;
+            case PROC_REQ:
+                rem_dta = obd_handle_request(req.dta, req.len, dta);
 
-                if (rem_dta > 7)
+                if (rem_dta > obd_tp_t::SF_DATA_MAX)
                 {
                     state = TX_SEND_FRST;
                 }
@@ -187,10 +767,8 @@ static void twai_control_task(void *arg)
                     rem_dta
                     );
                 out_msg.identifier = ID_SLAVE_RESP_DTA;
-                out_msg.data_length_code = 8;
                 frame_len = rem_dta;
-                out_msg.data[0] = frame_len; // 0x0L
-                memcpy(&out_msg.data[1], &dta[dta_len], frame_len);
+                out_msg.data_length_code = obd_tp_t::single(out_msg.data, &dta[dta_len], frame_len);
                 dta_len += frame_len;
                 rem_dta -= frame_len;
 
@@ -204,11 +782,8 @@ static void twai_control_task(void *arg)
                     rem_dta
                     );
                 out_msg.identifier = ID_SLAVE_RESP_DTA;
-                out_msg.data_length_code = 8;
-                frame_len = 6;
-                out_msg.data[0] = (0x01 << 4) | LSB_NIBBLE(MSB_BYTE(rem_dta));
-                out_msg.data[1] = LSB_BYTE(rem_dta);
-                memcpy(&out_msg.data[2], &dta[dta_len], frame_len);
+                frame_len = obd_tp_t::FF_DATA_LEN;
+                out_msg.data_length_code = obd_tp_t::first(out_msg.data, &dta[dta_len], rem_dta);
                 dta_len += frame_len;
                 rem_dta -= frame_len;
                 counter = 1;
@@ -219,8 +794,14 @@ static void twai_control_task(void *arg)
             case RX_RECV_FLOW:
                 ESP_LOGI(CTRL_TAG, "receive clear-to-send");
                 twai_receive(&inc_msg, portMAX_DELAY);
-                clear_to_send = inc_msg.data[1];
-                cons_delay = inc_msg.data[2];
+                if (obd_tp_t::type(inc_msg.data) != isotp::frame_type_t::FLOW)
+                {
+                    ESP_LOGE(CTRL_TAG, "identified unexpected frame!");
+                    state = IDLE;
+                    break;
+                }
+                clear_to_send = obd_tp_t::flow_block_size(inc_msg.data);
+                cons_delay = obd_tp_t::flow_st_min(inc_msg.data);
                 
                 ESP_LOGI(
                     CTRL_TAG,
@@ -241,14 +822,16 @@ static void twai_control_task(void *arg)
                 );
 
                 out_msg.identifier = ID_SLAVE_RESP_DTA;
-                out_msg.data_length_code = 8;
-                frame_len = MIN(7, rem_dta);
-                out_msg.data[0] = 0x20 + counter;
-                memcpy(&out_msg.data[1], &dta[dta_len], frame_len);
+                frame_len = obd_tp_t::consecutive_len(rem_dta);
+                out_msg.data_length_code = obd_tp_t::consecutive(
+                    out_msg.data,
+                    counter,
+                    &dta[dta_len],
+                    frame_len);
                 twai_transmit(&out_msg, portMAX_DELAY);
                 dta_len += frame_len;
                 rem_dta -= frame_len;
-                counter = (counter + 1) % 0x0F;
+                counter = (counter + 1) & 0x0F; // sequence number wraps 0xF -> 0x0
 
                 if (rem_dta)
                 {
@@ -280,21 +863,72 @@ static void twai_control_task(void *arg)
     }
 }
 
-static void obd_info_task(void *arg)
+static void periodic_timer_cb(TimerHandle_t timer)
+{
+    xSemaphoreGive(periodic_tick_sem);
+}
+
+// pushes every scheduled periodic did when its rate is due, woken by the
+// periodic timer once per fast rate period
+static void periodic_tx_task(void *arg)
 {
-    TickType_t x_last_wake_time;
-    const TickType_t x_period = INFO_UPDATE_PERIOD;
-    x_last_wake_time = xTaskGetTickCount();
+    twai_message_t out_msg[UDS_PERIODIC_COUNT];
+    uint8_t due[UDS_PERIODIC_COUNT];
+    uint8_t dta[UDS_DID_MAX_LEN];
+    uint32_t tick = 0;
+    int due_count;
+    int count;
+    int len;
 
     for (;;)
     {
-        vTaskDelayUntil(&x_last_wake_time, x_period);
-        uint32_t rand = esp_random();
+        xSemaphoreTake(periodic_tick_sem, portMAX_DELAY);
+        tick++;
+        due_count = 0;
+        count = 0;
+
+        // pick the due periodic dids under the lock, sample after releasing it
+        xSemaphoreTake(uds_did_mut, portMAX_DELAY);
+        for (int i = 0; i < UDS_PERIODIC_COUNT; i++)
+        {
+            if (periodic[i].rate && !(tick % periodic_ticks[periodic[i].rate]))
+            {
+                due[due_count++] = periodic[i].pdid;
+            }
+        }
+        xSemaphoreGive(uds_did_mut);
+
+        for (int i = 0; i < due_count; i++)
+        {
+            len = did_read(UDS_DID_PERIODIC(due[i]), dta);
+            if (len < 0 || len > UDS_PERIODIC_DATA_MAX)
+            {
+                // did was cleared or redefined since scheduling
+                ESP_LOGE(TX_TAG, "dropped periodic did %02x!", due[i]);
+                xSemaphoreTake(uds_did_mut, portMAX_DELAY);
+                for (int j = 0; j < UDS_PERIODIC_COUNT; j++)
+                {
+                    if (periodic[j].pdid == due[i])
+                    {
+                        periodic[j].rate = 0;
+                    }
+                }
+                xSemaphoreGive(uds_did_mut);
+                continue;
+            }
+
+            memset(&out_msg[count], 0, sizeof(twai_message_t));
+            out_msg[count].identifier = ID_SLAVE_PERIODIC_DTA;
+            out_msg[count].data_length_code = 1 + len;
+            out_msg[count].data[0] = due[i];
+            memcpy(&out_msg[count].data[1], dta, len);
+            count++;
+        }
 
-        xSemaphoreTake(obd_info_mut, portMAX_DELAY);
-        speed = (uint8_t) (rand & 0xFF);
-        rpm = (uint16_t) ((rand >> 8) & 0xFFFF);
-        xSemaphoreGive(obd_info_mut);
+        for (int i = 0; i < count; i++)
+        {
+            twai_transmit(&out_msg[i], PERIODIC_TICK);
+        }
     }
 }
 
@@ -312,8 +946,19 @@ extern "C" void app_main(void)
     }
 
     // create semaphores and tasks
-    obd_info_mut = xSemaphoreCreateMutex();
+    for (int i = 0; i < SIGNAL_COUNT; i++)
+    {
+        obd_signals[i].mut = xSemaphoreCreateMutex();
+    }
+    uds_did_mut = xSemaphoreCreateMutex();
     twai_task_sem = xSemaphoreCreateBinary();
+    periodic_tick_sem = xSemaphoreCreateBinary();
+    periodic_timer = xTimerCreate(
+        "periodic",
+        PERIODIC_TICK,
+        pdTRUE,
+        NULL,
+        periodic_timer_cb);
 
     ESP_LOGI(MAIN_TAG, "starting tasks");
 
@@ -327,11 +972,11 @@ extern "C" void app_main(void)
         tskNO_AFFINITY);
 
     xTaskCreatePinnedToCore(
-        obd_info_task,
-        "OBD_rng",
+        periodic_tx_task,
+        "UDS_periodic",
         16384,
         NULL,
-        OBD_TASK_PRIO,
+        TX_TASK_PRIO,
         NULL,
         tskNO_AFFINITY);
 
@@ -341,6 +986,7 @@ extern "C" void app_main(void)
 
     // start control task
     xSemaphoreGive(twai_task_sem);
+    xTimerStart(periodic_timer, portMAX_DELAY);
 
     // tasks running, return :)
     return;